@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include "devices/ide.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Most sectors merged into one driver call, the size of a
+   device's bounce buffer. */
+#define BLOCK_MERGE_SECTORS (4 * PGSIZE / BLOCK_SECTOR_SIZE)
 
 /* A block device. */
 struct block
@@ -19,6 +27,17 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long merge_cnt;       /* Number of requests merged. */
+
+    /* Request queue. */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_nonempty;    /* Signaled on submission. */
+    struct list queue;                  /* Pending requests, by sector. */
+    block_sector_t head;                /* Sector after the last served. */
+    unsigned next_seq;                  /* Sequence number for the next. */
+    bool started;                       /* start_queue() called? */
+    bool running;                       /* Queue thread running? */
+    void *bounce;                       /* Buffer for merged requests. */
   };
 
 /* List of all block devices. */
@@ -29,6 +48,12 @@ static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
 
+static bool request_less (const struct list_elem *, const struct list_elem *,
+                          void *aux);
+static void transfer (struct block *, block_sector_t, size_t cnt,
+                      void *buffer, bool write);
+static void start_queue (struct block *);
+
 /* Returns a human-readable name for the given block device
    TYPE. */
 const char *
@@ -120,9 +145,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +156,322 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, buffer);
+}
+
+/* Completion function of a synchronous request: wakes up the
+   thread waiting on semaphore DONE. */
+static void
+wake_up (struct block_request *r UNUSED, void *done)
+{
+  sema_up (done);
+}
+
+/* Submits a request like R and waits for it to complete. */
+static void
+submit_and_wait (struct block *block, block_sector_t sector, size_t cnt,
+                 void *buffer, bool write)
+{
+  struct block_request r;
+  struct semaphore done;
+
+  if (cnt == 0)
+    return;
+  sema_init (&done, 0);
+  block_request_init (&r, sector, cnt, buffer, write, wake_up, &done);
+  block_submit (block, &r);
+  sema_down (&done);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that can move several sectors per command do
+   so; for others this is the same as CNT calls to block_read().
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     size_t cnt, void *buffer)
+{
+  submit_and_wait (block, sector, cnt, buffer, false);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.  Drivers that can move several sectors per command
+   do so; for others this is the same as CNT calls to
+   block_write().
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  submit_and_wait (block, sector, cnt, (void *) buffer, true);
+}
+
+/* Initializes request R to read CNT sectors starting at SECTOR
+   into BUFFER, or to write them from BUFFER if WRITE, and to call
+   COMPLETE with AUX when done. */
+void
+block_request_init (struct block_request *r, block_sector_t sector,
+                    size_t cnt, void *buffer, bool write,
+                    block_complete_func *complete, void *aux)
+{
+  r->sector = sector;
+  r->cnt = cnt;
+  r->buffer = buffer;
+  r->write = write;
+  r->complete = complete;
+  r->aux = aux;
+}
+
+/* Queues request R to BLOCK and returns without waiting for it.
+   A device whose driver forwards requests, like a partition,
+   passes R on to the device below, which may change its SECTOR.
+   Otherwise BLOCK's thread is started on the first request; if
+   that fails, R is served and completed before returning. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  ASSERT (r->cnt > 0);
+  check_sector (block, r->sector);
+  check_sector (block, r->sector + r->cnt - 1);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  if (block->ops->submit != NULL)
+    {
+      if (r->write)
+        block->write_cnt += r->cnt;
+      else
+        block->read_cnt += r->cnt;
+      block->ops->submit (block->aux, r);
+      return;
+    }
+
+  lock_acquire (&block->queue_lock);
+  if (!block->started)
+    start_queue (block);
+  if (block->running)
+    {
+      r->seq = block->next_seq++;
+      list_insert_ordered (&block->queue, &r->elem, request_less, NULL);
+      cond_signal (&block->queue_nonempty, &block->queue_lock);
+      lock_release (&block->queue_lock);
+    }
+  else
+    {
+      lock_release (&block->queue_lock);
+      transfer (block, r->sector, r->cnt, r->buffer, r->write);
+      r->complete (r, r->aux);
+    }
+}
+
+/* Orders requests by sector, keeping submission order among
+   requests for the same sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+  return a->sector < b->sector;
+}
+
+/* Returns true if A was submitted before B, and they overlap, and
+   one of them writes, so that A must be served first. */
+static bool
+must_precede (const struct block_request *a, const struct block_request *b)
+{
+  return (int) (a->seq - b->seq) < 0
+         && (a->write || b->write)
+         && a->sector < b->sector + b->cnt
+         && b->sector < a->sector + a->cnt;
+}
+
+/* Returns the oldest request in BLOCK's queue that must be served
+   before R, following the chain back, or R if there is none. */
+static struct block_request *
+first_to_serve (struct block *block, struct block_request *r)
+{
+  for (;;)
+    {
+      struct block_request *first = NULL;
+      struct list_elem *e;
+
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        {
+          struct block_request *p = list_entry (e, struct block_request, elem);
+          if (must_precede (p, r)
+              && (first == NULL || (int) (p->seq - first->seq) < 0))
+            first = p;
+        }
+      if (first == NULL)
+        return r;
+      r = first;
+    }
+}
+
+/* Takes the requests to serve next off BLOCK's queue, which must
+   not be empty, into RUN.  C-LOOK picks the first request at or
+   after the sector the last transfer ended at, or else the lowest
+   one; requests in the same direction that continue it are merged
+   while they fit in the bounce buffer.  Returns the number of
+   requests taken. */
+static size_t
+take_requests (struct block *block, struct block_request **run)
+{
+  struct block_request *r = NULL;
+  struct list_elem *e;
+  size_t n, cnt;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *p = list_entry (e, struct block_request, elem);
+      if (p->sector >= block->head)
+        {
+          r = p;
+          break;
+        }
+    }
+  if (r == NULL)
+    r = list_entry (list_front (&block->queue), struct block_request, elem);
+  r = first_to_serve (block, r);
+  list_remove (&r->elem);
+  run[0] = r;
+  n = 1;
+  cnt = r->cnt;
+
+  while (block->bounce != NULL)
+    {
+      block_sector_t end = run[n - 1]->sector + run[n - 1]->cnt;
+      struct block_request *next = NULL;
+
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        {
+          struct block_request *p = list_entry (e, struct block_request, elem);
+          if (p->sector > end)
+            break;
+          if (p->sector == end && p->write == r->write
+              && cnt + p->cnt <= BLOCK_MERGE_SECTORS
+              && first_to_serve (block, p) == p)
+            {
+              next = p;
+              break;
+            }
+        }
+      if (next == NULL)
+        break;
+      list_remove (&next->elem);
+      run[n++] = next;
+      cnt += next->cnt;
+    }
+
+  block->head = run[n - 1]->sector + run[n - 1]->cnt;
+  return n;
+}
+
+/* Moves CNT sectors starting at SECTOR between BLOCK's driver and
+   BUFFER, in one call if the driver can. */
+static void
+transfer (struct block *block, block_sector_t sector, size_t cnt,
+          void *buffer, bool write)
+{
+  size_t i;
+
+  if (write)
+    {
+      if (block->ops->write_multiple != NULL)
+        block->ops->write_multiple (block->aux, sector, cnt, buffer);
+      else
+        for (i = 0; i < cnt; i++)
+          block->ops->write (block->aux, sector + i,
+                             (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+      block->write_cnt += cnt;
+    }
+  else
+    {
+      if (block->ops->read_multiple != NULL)
+        block->ops->read_multiple (block->aux, sector, cnt, buffer);
+      else
+        for (i = 0; i < cnt; i++)
+          block->ops->read (block->aux, sector + i,
+                            (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+      block->read_cnt += cnt;
+    }
+}
+
+/* Serves BLOCK's queue for as long as the kernel runs.  A merged
+   run goes through the bounce buffer, so the driver sees one
+   contiguous transfer. */
+static void
+block_queue_thread (void *block_)
+{
+  struct block *block = block_;
+  struct block_request *run[BLOCK_MERGE_SECTORS];
+
+  for (;;)
+    {
+      size_t n, i;
+
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_nonempty, &block->queue_lock);
+      n = take_requests (block, run);
+      lock_release (&block->queue_lock);
+
+      if (n == 1)
+        transfer (block, run[0]->sector, run[0]->cnt, run[0]->buffer,
+                  run[0]->write);
+      else
+        {
+          uint8_t *bounce = block->bounce;
+          bool write = run[0]->write;
+          size_t cnt;
+
+          for (i = 0, cnt = 0; i < n; cnt += run[i++]->cnt)
+            if (write)
+              memcpy (bounce + cnt * BLOCK_SECTOR_SIZE, run[i]->buffer,
+                      run[i]->cnt * BLOCK_SECTOR_SIZE);
+          transfer (block, run[0]->sector, cnt, bounce, write);
+          for (i = 0, cnt = 0; i < n; cnt += run[i++]->cnt)
+            if (!write)
+              memcpy (run[i]->buffer, bounce + cnt * BLOCK_SECTOR_SIZE,
+                      run[i]->cnt * BLOCK_SECTOR_SIZE);
+          block->merge_cnt += n - 1;
+        }
+
+      for (i = 0; i < n; i++)
+        run[i]->complete (run[i], run[i]->aux);
+    }
+}
+
+/* Starts the thread serving BLOCK's queue and allocates its bounce
+   buffer, once.  Without a bounce buffer, requests are not merged;
+   without a thread, they are served as they are submitted, and
+   the bounce buffer is not needed.  Must be called with BLOCK's
+   queue lock held. */
+static void
+start_queue (struct block *block)
+{
+  size_t bounce_pages = BLOCK_MERGE_SECTORS * BLOCK_SECTOR_SIZE / PGSIZE;
+  char name[sizeof block->name + 2];
+
+  ASSERT (!block->started);
+  block->started = true;
+  block->bounce = palloc_get_multiple (0, bounce_pages);
+  snprintf (name, sizeof name, "%s-q", block->name);
+  block->running = thread_create (name, PRI_MAX, block_queue_thread,
+                                  block) != TID_ERROR;
+  if (!block->running && block->bounce != NULL)
+    {
+      palloc_free_multiple (block->bounce, bounce_pages);
+      block->bounce = NULL;
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -171,9 +506,9 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          printf ("%s (%s): %llu reads, %llu writes, %llu merged\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->write_cnt, block->merge_cnt);
         }
     }
 }
@@ -200,6 +535,15 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->merge_cnt = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_nonempty);
+  list_init (&block->queue);
+  block->head = 0;
+  block->next_seq = 0;
+  block->started = false;
+  block->running = false;
+  block->bounce = NULL;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
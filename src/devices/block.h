@@ -1,6 +1,8 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <list.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
 
@@ -53,9 +55,49 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+
+   block_submit() queues a request and returns at once.  Each
+   disk serves its queue from a kernel thread of its own, in
+   C-LOOK order: ascending sectors from the last one served,
+   wrapping back to the lowest.  Requests for adjacent sectors in
+   the same direction are merged into one driver call.  A request
+   never overtakes an older one for an overlapping sector if
+   either writes.
+
+   When the transfer is done, COMPLETE is called from the
+   device's thread with the request and AUX.  It may sleep, but
+   it must not wait for another request to the same device.  The
+   request and its buffer belong to the block layer until then.
+   Requests to a partition go to its disk's queue, with SECTOR
+   changed to the disk's numbering. */
+struct block_request;
+typedef void block_complete_func (struct block_request *, void *aux);
+
+struct block_request
+  {
+    struct list_elem elem;              /* Element in device queue. */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                         /* Write, rather than read? */
+    block_complete_func *complete;      /* Called when done. */
+    void *aux;                          /* Passed to COMPLETE. */
+    unsigned seq;                       /* Order of submission. */
+  };
+
+void block_request_init (struct block_request *, block_sector_t, size_t cnt,
+                         void *buffer, bool write,
+                         block_complete_func *, void *aux);
+void block_submit (struct block *, struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -65,6 +107,18 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Transfer CNT consecutive sectors at once.  Optional: if
+       null, the block layer makes CNT calls to read or write. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+
+    /* Optional: passes a checked request on to another device
+       instead of queueing it here.  Devices with it get no queue
+       thread of their own. */
+    void (*submit) (void *aux, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
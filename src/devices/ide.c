@@ -3,12 +3,15 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -24,6 +27,12 @@
 #define reg_status(CHANNEL) ((CHANNEL)->reg_base + 7)   /* Status (r/o). */
 #define reg_command(CHANNEL) reg_status (CHANNEL)       /* Command (w/o). */
 
+/* Bus master IDE port addresses, per channel.  The controller's
+   bus master registers are found through PCI. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
 /* ATA control block port addresses.
    (If we supported non-legacy ATA controllers this would not be
    flexible enough, but it's fine for what we do.) */
@@ -34,6 +43,15 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
+
+/* Bus Master Command Register bits. */
+#define BMC_START 0x01          /* Start transfer. */
+#define BMC_READ 0x08           /* Transfer from disk to memory. */
+
+/* Bus Master Status Register bits. */
+#define BMS_ERR 0x02            /* Transfer failed (write 1 to clear). */
+#define BMS_INTR 0x04           /* Disk interrupted (write 1 to clear). */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +67,15 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors a single command can transfer: a sector count
+   of 0 means 256. */
+#define MAX_COMMAND_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +84,23 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt for READ and
+                                   WRITE MULTIPLE, 0 if unsupported. */
+    bool dma;                   /* Transfer by bus master DMA? */
   };
 
+/* A physical region descriptor.  A channel's PRD table lists the
+   memory a DMA transfer moves, a run of physical memory that does
+   not cross a 64 kB boundary per entry. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, even. */
+    uint16_t size;              /* Byte count, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT in the last entry. */
+  };
+
+#define PRD_EOT 0x8000          /* End of table. */
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -72,6 +114,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master I/O port, 0 if no DMA. */
+    struct prd *prdt;           /* PRD table, a page. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,11 +126,24 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+/* Use bus master DMA where the hardware supports it?  Off unless
+   requested with -dma. */
+static bool use_dma;
+
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, int max_multiple);
+
+static uint16_t find_bus_master (void);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *buffer, bool read);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      uint8_t *buffer);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const uint8_t *buffer);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -97,10 +155,19 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
+/* Makes ide_init() look for a bus master IDE controller and move
+   data by DMA if ENABLE.  Must be called before ide_init(). */
+void
+ide_set_dma (bool enable)
+{
+  use_dma = enable;
+}
+
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
+  uint16_t bm_base = use_dma ? find_bus_master () : 0;
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +193,16 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+
+      /* Each channel has 8 bus master ports, primary first. */
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + 8 * chan_no;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +213,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -289,6 +368,15 @@ identify_ata_device (struct ata_disk *d)
   snprintf (extra_info, sizeof extra_info,
             "model \"%s\", serial \"%s\"", model, serial);
 
+  /* The low byte of word 47 is the most sectors the disk can
+     move per interrupt with READ and WRITE MULTIPLE. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+
+  /* Bit 8 of word 49 says whether the disk supports DMA. */
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+  if (d->dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
      allow access to those, we're less likely to scribble on
@@ -309,6 +397,30 @@ identify_ata_device (struct ata_disk *d)
   partition_scan (block);
 }
 
+/* Enables READ and WRITE MULTIPLE on disk D with the largest
+   power of 2 sectors per interrupt that exceeds neither
+   MAX_MULTIPLE nor a page.  Leaves them disabled if D does not
+   support them and disables them if D rejects the setting. */
+static void
+set_multiple_mode (struct ata_disk *d, int max_multiple)
+{
+  struct channel *c = d->channel;
+  int multiple = 1;
+
+  if (max_multiple < 2)
+    return;
+  while (multiple * 2 <= max_multiple
+         && multiple * 2 <= PGSIZE / BLOCK_SECTOR_SIZE)
+    multiple *= 2;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  d->multiple = (inb (reg_status (c)) & STA_ERR) == 0 ? multiple : 0;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +449,332 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Each
+   command moves up to MAX_COMMAND_SECTORS sectors, by DMA if D
+   supports it and by PIO otherwise.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+      if (!dma_transfer (d, sec_no, cmd_cnt, buffer, true))
+        pio_read (d, sec_no, cmd_cnt, buffer);
+      sec_no += cmd_cnt;
+      buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+      cnt -= cmd_cnt;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.  Commands
+   are issued as in ide_read_multiple().
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+      /* DMA only reads BUFFER, whatever the direction flag says. */
+      if (!dma_transfer (d, sec_no, cmd_cnt, (void *) buffer, false))
+        pio_write (d, sec_no, cmd_cnt, buffer);
+      sec_no += cmd_cnt;
+      buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+      cnt -= cmd_cnt;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d_, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d_, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
 
+/* Reads CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO from disk D into BUFFER in PIO mode.  With READ MULTIPLE
+   the disk interrupts once per D->multiple sectors instead of
+   once per sector.  D's channel must be locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  bool multiple = cnt > 1 && d->multiple > 0;
+  size_t block_cnt = multiple ? (size_t) d->multiple : 1;
+  size_t done, i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, multiple ? CMD_READ_MULTIPLE
+                                 : CMD_READ_SECTOR_RETRY);
+  for (done = 0; done < cnt; done += block_cnt)
+    {
+      /* The disk interrupts when each block of BLOCK_CNT sectors
+         is ready.  The last one may be short. */
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      for (i = done; i < done + block_cnt && i < cnt; i++)
+        input_sector (c, buffer + i * BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Writes CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO to disk D from BUFFER in PIO mode, as pio_read() reads
+   them.  D's channel must be locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  bool multiple = cnt > 1 && d->multiple > 0;
+  size_t block_cnt = multiple ? (size_t) d->multiple : 1;
+  size_t done, i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, multiple ? CMD_WRITE_MULTIPLE
+                                 : CMD_WRITE_SECTOR_RETRY);
+  for (done = 0; done < cnt; done += block_cnt)
+    {
+      /* The disk asks for the first block right away and
+         interrupts once it has taken each block, the last one
+         included. */
+      if (done > 0)
+        sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      for (i = done; i < done + block_cnt && i < cnt; i++)
+        output_sector (c, buffer + i * BLOCK_SECTOR_SIZE);
+    }
+  sema_down (&c->completion_wait);
+}
+
+/* Bus master DMA. */
+
+/* PCI configuration space, reached through configuration
+   mechanism #1. */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+#define PCI_REG_ID 0x00         /* Device ID, vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Status, command. */
+#define PCI_REG_CLASS 0x08      /* Class, subclass, prog IF, revision. */
+#define PCI_REG_BAR4 0x20       /* Base address register 4. */
+
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as bus master. */
+
+/* Returns the 32-bit register at offset REG in the configuration
+   space of PCI function FUNC of device DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS, 0x80000000 | dev << 11 | func << 8 | reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit register at offset REG in the
+   configuration space of PCI function FUNC of device DEV on
+   bus 0. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDRESS, 0x80000000 | dev << 11 | func << 8 | reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that drives the legacy
+   channels and can act as bus master, as the PIIX in a PC or
+   QEMU does.  Lets it master the bus and returns the base of its
+   bus master I/O ports, or 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar, command;
+
+        if ((pci_read_config (dev, func, PCI_REG_ID) & 0xffff) == 0xffff)
+          continue;
+
+        /* Mass storage controller, IDE, with bit 7 of the
+           programming interface set for bus mastering and bits 0
+           and 2 clear for the legacy ports. */
+        class = pci_read_config (dev, func, PCI_REG_CLASS);
+        if (class >> 16 != 0x0101 || (class & 0x8500) != 0x8000)
+          continue;
+        bar = pci_read_config (dev, func, PCI_REG_BAR4);
+        if ((bar & 1) == 0 || (bar & 0xfffc) == 0)
+          continue;
+
+        /* Writing 0 to the status half clears nothing. */
+        command = pci_read_config (dev, func, PCI_REG_COMMAND) & 0xffff;
+        pci_write_config (dev, func, PCI_REG_COMMAND,
+                          command | PCI_CMD_IO | PCI_CMD_MASTER);
+        return bar & 0xfffc;
+      }
+  return 0;
+}
+
+/* Fills channel C's PRD table with the physical regions of the
+   SIZE bytes at BUFFER.  Returns false if DMA cannot reach
+   BUFFER.  Kernel virtual memory maps physical memory in order,
+   so BUFFER is one physical run, split at 64 kB boundaries. */
+static bool
+fill_prdt (struct channel *c, const void *buffer, size_t size)
+{
+  uintptr_t addr;
+  size_t i = 0;
+
+  if (!is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1) != 0)
+    return false;
+
+  addr = vtop (buffer);
+  while (size > 0)
+    {
+      size_t chunk = 0x10000 - (addr & 0xffff);
+      if (chunk > size)
+        chunk = size;
+      c->prdt[i].addr = addr;
+      c->prdt[i].size = chunk & 0xffff;
+      c->prdt[i].flags = 0;
+      addr += chunk;
+      size -= chunk;
+      i++;
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+  return true;
+}
+
+/* Brings channel C back to a known state after a failed command,
+   which may have left a transfer or an interrupt pending: resets
+   it, forgets interrupts counted so far, and restores the
+   multiple mode of its disks.  C must be locked. */
+static void
+recover_channel (struct channel *c)
+{
+  int dev_no;
+
+  reset_channel (c);
+  while (sema_try_down (&c->completion_wait))
+    continue;
+  for (dev_no = 0; dev_no < 2; dev_no++)
+    {
+      struct ata_disk *d = &c->devices[dev_no];
+      if (d->is_ata && d->multiple > 0)
+        set_multiple_mode (d, d->multiple);
+    }
+}
+
+/* Moves CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO between disk D and BUFFER by bus master DMA: into BUFFER
+   if READ, out of it otherwise.  The CPU is free for other
+   threads until the disk interrupts at the end.  D's channel must
+   be locked.
+
+   Returns false, having moved nothing, if D or BUFFER cannot use
+   DMA; the caller then falls back to PIO.  A failed transfer
+   also returns false, after turning DMA off for D. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool read)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = read ? BMC_READ : 0;
+  uint8_t bm_status, status;
+
+  if (!d->dma || !fill_prdt (c, buffer, cnt * BLOCK_SECTOR_SIZE))
+    return false;
+
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c),
+        inb (reg_bm_status (c)) | BMS_ERR | BMS_INTR);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, read ? CMD_READ_DMA : CMD_WRITE_DMA);
+  outb (reg_bm_command (c), direction | BMC_START);
+  sema_down (&c->completion_wait);
+  outb (reg_bm_command (c), direction);
+
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), bm_status | BMS_ERR | BMS_INTR);
+  status = inb (reg_alt_status (c));
+  if ((bm_status & BMS_ERR) != 0 || (status & STA_ERR) != 0)
+    {
+      printf ("%s: DMA transfer failed, sector=%"PRDSNu", "
+              "falling back to PIO\n", d->name, sec_no);
+      d->dma = false;
+      recover_channel (c);
+      return false;
+    }
+  return true;
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between
+   1 and MAX_COMMAND_SECTORS, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_COMMAND_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_COMMAND_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -1,6 +1,9 @@
 #ifndef DEVICES_IDE_H
 #define DEVICES_IDE_H
 
+#include <stdbool.h>
+
 void ide_init (void);
+void ide_set_dma (bool);
 
 #endif /* devices/ide.h */
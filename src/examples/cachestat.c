@@ -0,0 +1,36 @@
+/* cachestat.c
+
+   Prints the kernel's buffer cache statistics. */
+
+#include <syscall.h>
+#include <stdio.h>
+
+static void
+print_histogram (const char *name, const unsigned long long *hist)
+{
+  int i;
+
+  printf ("%s ticks:", name);
+  for (i = 0; i + 1 < CACHESTAT_BUCKETS; i++)
+    printf (" <%d: %llu,", 1 << i, hist[i]);
+  printf (" more: %llu\n", hist[CACHESTAT_BUCKETS - 1]);
+}
+
+int
+main (void)
+{
+  struct cache_stats s;
+  unsigned long long lookups;
+
+  cachestat (&s);
+  lookups = s.hits + s.misses;
+  printf ("%llu blocks, %llu hits, %llu misses", s.blocks, s.hits, s.misses);
+  if (lookups > 0)
+    printf (" (%llu%% hit rate)", s.hits * 100 / lookups);
+  printf ("\n%llu evictions, %llu write-backs\n", s.evictions, s.write_backs);
+  printf ("%llu flushes in %llu ticks, %llu waits for %llu ticks\n",
+          s.flushes, s.flush_ticks, s.waits, s.wait_ticks);
+  print_histogram ("flush", s.flush_hist);
+  print_histogram ("wait", s.wait_hist);
+  return EXIT_SUCCESS;
+}
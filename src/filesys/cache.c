@@ -1,6 +1,6 @@
 //
 //  cache.c
-//  
+//
 //
 //  Created by Yang Jiang on 5/14/21.
 //
@@ -9,6 +9,8 @@
 #include <round.h>
 #include <list.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 
 #include "lib/kernel/hash.h"
 #include "devices/timer.h"
@@ -17,368 +19,1344 @@
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/interrupt.h"
+#include "threads/loader.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "lib/user/syscall.h"
 
 #include "cache.h"
 
 struct cache_entry {
     struct list_elem elem;
+    struct hash_elem hash_elem;     /* Element in shard map, keyed by sector_no. */
+    struct list_elem dirty_elem;    /* Element in shard dirty list. */
     
     uint8_t score;
+    uint8_t queue;                  /* 2Q queue holding the entry. */
+    uint8_t log;                    /* Journal state of the block. */
     bool dirty;
-    int sector_no;
+    block_sector_t sector_no;
     
-    uint32_t read_ref;
-    uint32_t write_ref;
+    struct rwlock rw;               /* Held shared by readers of the block,
+                                       exclusively by its writer. */
     
-    enum cache_action state;
+    void *data;                     /* Cached sector, within a cache page. */
+    struct cache_shard *shard;      /* Shard owning the entry. */
+};
+
+/* The cache grows and shrinks a page at a time. Entry I of a page
+   belongs to shard I % CACHE_NSHARDS, so every page adds the same
+   number of entries to each shard. A shrunk page gives its memory
+   back but keeps its struct, since lookups may still hold pointers
+   to its entries; grow reuses it. */
+#define CACHE_PAGE_NBLOCKS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+struct cache_page {
+    struct list_elem elem;          /* Element in cache_pages or retired_pages. */
+    void *kpage;                    /* Memory of the page, NULL if retired. */
+    struct cache_entry entries[CACHE_PAGE_NBLOCKS];
+};
+
+/* The cache is partitioned into CACHE_NSHARDS independently locked
+   shards. A sector always lives in shard (sector % CACHE_NSHARDS),
+   which owns an equal share of the entries of every cache page.
+   Lookup, allocation and eviction only take the lock of that shard.
+   sector_no of an entry changes only under both the shard lock and
+   an exclusive hold of its rw, and dirty only under a hold of rw, so
+   flushing does not need the shard lock at all. */
+struct cache_shard {
+    struct lock lock;               /* Protects everything below but the
+                                       dirty list. */
+    struct hash map;                /* sector -> cache entry. */
+    struct list in_use;             /* Clock: entries in clock order.
+                                       2Q: Am, most recent first. */
+    struct list_elem *clock_iter;   /* Clock hand for eviction. */
+    struct list a1in;               /* 2Q: blocks seen once, newest first. */
+    size_t a1in_cnt;
+    block_sector_t *ghost;          /* 2Q: A1out, sectors recently evicted
+                                       from a1in, oldest first. */
+    size_t ghost_cnt;
+    struct list free;               /* Entries holding no sector. */
+    size_t nblocks;                 /* Entries owned, free or not. */
     
-    struct lock block_lock;
-    struct condition read_cv;
-    struct condition write_cv;
+    struct lock dirty_lock;         /* Protects dirty, dirty_cnt, log_cnt.
+                                       Never held while acquiring another
+                                       lock. */
+    struct list dirty;              /* Dirty entries. */
+    size_t dirty_cnt;
+    size_t log_cnt;                 /* Entries waiting for the journal. */
+};
+
+/* Replacement policy. Every hook is called with the shard lock held.
+   evict() picks an unreferenced entry, preferring clean ones, and
+   returns it held exclusively and dropped from the policy's
+   lists, or NULL if every entry of the shard is busy. */
+struct cache_policy {
+    const char *name;
+    void (*insert) (struct cache_shard *, struct cache_entry *); /* Entry now caches a sector. */
+    void (*touch) (struct cache_shard *, struct cache_entry *);  /* Entry was hit. */
+    void (*remove) (struct cache_shard *, struct cache_entry *); /* Entry is dropped. */
+    struct cache_entry *(*evict) (struct cache_shard *);
 };
 
-static void *cache_base;
-static void *used_map;
+static struct cache_entry *clock_evict(struct cache_shard *);
+static void clock_insert(struct cache_shard *, struct cache_entry *);
+static void clock_touch(struct cache_shard *, struct cache_entry *);
+static void clock_remove(struct cache_shard *, struct cache_entry *);
+static struct cache_entry *twoq_evict(struct cache_shard *);
+static void twoq_insert(struct cache_shard *, struct cache_entry *);
+static void twoq_touch(struct cache_shard *, struct cache_entry *);
+static void twoq_remove(struct cache_shard *, struct cache_entry *);
 
-static void evict_block();
-static void* fetch_new_cache_block(block_sector_t, enum cache_action);
+static const struct cache_policy clock_policy =
+    {"clock", clock_insert, clock_touch, clock_remove, clock_evict};
+static const struct cache_policy twoq_policy =
+    {"2q", twoq_insert, twoq_touch, twoq_remove, twoq_evict};
+static const struct cache_policy *cache_policy = &clock_policy;
+
+/* 2Q queue of an entry. A victim is unlinked while lookups may still
+   find it until it is written back, so hits on it must leave the
+   lists alone. */
+enum twoq_queue { TWOQ_NONE, TWOQ_A1IN, TWOQ_AM };
+
+/* Journal state of a block. A metadata block changed through
+   cache_log() may not be written back before its new contents are
+   committed to the journal, and a committed one is left for the
+   journal's checkpoint or cache pressure to write back. */
+enum log_state {
+    LOG_NONE,                       /* Written back freely. */
+    LOG_PENDING,                    /* Changed since last logged. */
+    LOG_WRITING,                    /* Going into the log. */
+    LOG_DONE                        /* Committed, not yet written back. */
+};
+
+static void* fetch_new_cache_block(block_sector_t, enum cache_action, bool);
 
 static void init_cache_block(struct cache_entry*);
-static void setup_cache_block(struct cache_entry*, size_t, enum cache_action);
+static void setup_cache_block(struct cache_shard*, struct cache_entry*, block_sector_t);
+
+static struct cache_entry *cache_lookup(struct cache_shard *, block_sector_t);
+static struct cache_entry *cache_to_entry(const void *);
+static void *cache_fetch_sector(block_sector_t, struct cache_entry *, enum cache_action);
+static void cache_write_behind(size_t, bool);
+static size_t cache_grow(size_t, bool);
+static bool claim_victim(struct cache_entry *, bool);
+static void cache_resize(void);
+
+static struct cache_shard cache_shards[CACHE_NSHARDS];
+
+/* Whether cache_log() holds metadata blocks for the journal. */
+static bool cache_logging;
+
+/* Cache pages, indexed by physical frame number so a pointer into
+   the cache leads to its entry, as in the frame table. resize_lock
+   protects the page lists and cache_nblocks. */
+static struct cache_page **cache_page_table;
+static struct list cache_pages;
+static struct list retired_pages;
+static struct lock resize_lock;
+static size_t cache_nblocks;
+static size_t cache_max_nblocks = CACHE_MAX_NBLOCKS;
+
+/* A shard whose entries are all busy or waiting for the journal
+   cannot evict until the next commit, which may itself wait for the
+   thread that missed. The cache then grows past its ceiling, by at
+   most this many sectors, which it gives back at the next resize. */
+#define CACHE_OVERDRAFT_NBLOCKS 256
 
-static int cache_lookup(block_sector_t);
-static size_t compute_cache_index(void *);
-static void *cache_fetch_sector(block_sector_t, size_t, enum cache_action);
+/* Grow when more than one lookup in CACHE_GROW_MISS_RATE missed
+   over a period of the flush thread, while more than
+   CACHE_RESERVE_PAGES kernel pages are free. Shrink when fewer are
+   free. */
+#define CACHE_GROW_MISS_RATE 5
+#define CACHE_GROW_MAX_PAGES 8
+#define CACHE_RESERVE_PAGES 32
+static unsigned long long resize_hits;
+static unsigned long long resize_misses;
 
-static struct list cache_in_use;
-static struct list_elem *clock_iter;
+/* Write-behind: writers up write_behind_sema once more than half of
+   the cache is dirty, and the write_behind thread cleans down to a
+   quarter. flush_lock serializes it with the periodic flush and owns
+   flush_batch, which has room for every entry the cache may have. */
+static struct semaphore write_behind_sema;
+static struct lock flush_lock;
+static struct cache_entry **flush_batch;
 
-static struct lock cache_lock;
+/* A run of blocks is copied into run_buf, a page owned by
+   run_lock, and goes to disk as one request. */
+static struct lock run_lock;
+static void *run_buf;
 
-static struct cache_entry *cache_table;
-static struct thread *cache_flush_thread;
+/* Sectors queued for read-ahead, filled by cache_read_ahead thread.
+   A full queue drops new requests; read-ahead is only a hint. */
+static block_sector_t prefetch_queue[CACHE_PREFETCH_QUEUE];
+static size_t prefetch_head;
+static size_t prefetch_cnt;
+static struct lock prefetch_lock;
+static struct condition prefetch_cv;
+
+/* Counters are bumped from many threads and shards; interrupts are
+   turned off around each update so 64-bit adds stay whole. */
+static struct cache_stats stats;
 
 static void
-init_cache_block(struct cache_entry* e)
+stat_add(unsigned long long *cnt)
 {
-    e->dirty = false;
+    enum intr_level old_level = intr_disable();
+    (*cnt)++;
+    intr_set_level(old_level);
+}
+
+/* Counts an event that started at tick START in CNT, TOTAL and
+   histogram HIST. */
+static void
+stat_latency(unsigned long long *cnt, unsigned long long *total,
+             unsigned long long *hist, int64_t start)
+{
+    int64_t ticks = timer_elapsed(start);
+    size_t bucket = 0;
+    while (bucket + 1 < CACHESTAT_BUCKETS && ticks >= (1LL << bucket)) bucket++;
     
-    e->sector_no = -1;
-    e->read_ref = 0;
-    e->write_ref = 0;
+    enum intr_level old_level = intr_disable();
+    (*cnt)++;
+    *total += ticks;
+    hist[bucket]++;
+    intr_set_level(old_level);
+}
+
+static inline struct cache_shard *
+sector_to_shard(block_sector_t sector)
+{
+    return cache_shards + sector % CACHE_NSHARDS;
+}
+
+static inline void *
+entry_to_cache(struct cache_entry *e)
+{
+    return e->data;
+}
+
+static inline struct cache_shard *
+entry_to_shard(struct cache_entry *e)
+{
+    return e->shard;
+}
+
+/* Whether E may not be written back until the journal commits it. */
+static inline bool
+awaits_log(const struct cache_entry *e)
+{
+    return e->log == LOG_PENDING || e->log == LOG_WRITING;
+}
+
+/* Sets the journal state of E to LOG, keeping count of the entries
+   of its shard that wait for the journal. */
+static void
+set_log(struct cache_entry *e, enum log_state log)
+{
+    struct cache_shard *shard = entry_to_shard(e);
     
-    e->state = NOOP;
-    lock_init(&e->block_lock);
-    cond_init(&e->read_cv);
-    cond_init(&e->write_cv);
+    lock_acquire(&shard->dirty_lock);
+    if (awaits_log(e)) shard->log_cnt--;
+    e->log = log;
+    if (awaits_log(e)) shard->log_cnt++;
+    lock_release(&shard->dirty_lock);
 }
 
+static inline size_t
+cache_dirty_high(void)
+{
+    return cache_nblocks / 2;
+}
+
+static inline size_t
+cache_dirty_low(void)
+{
+    return cache_nblocks / 4;
+}
+
+static size_t
+cache_dirty_count(void)
+{
+    size_t cnt = 0;
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) cnt += cache_shards[i].dirty_cnt;
+    return cnt;
+}
+
+/* E must be held exclusively */
 static void
-setup_cache_block(struct cache_entry *e, size_t block_sector, enum cache_action action)
+mark_dirty(struct cache_entry *e)
 {
-    bool lock_held = true;
-    if (!lock_held_by_current_thread(&e->block_lock)) {
-      lock_acquire(&e->block_lock);
-      lock_held = false;
-    }
+    struct cache_shard *shard = entry_to_shard(e);
+    if (e->dirty) return;
+    
+    e->dirty = true;
+    lock_acquire(&shard->dirty_lock);
+    list_push_back(&shard->dirty, &e->dirty_elem);
+    shard->dirty_cnt++;
+    lock_release(&shard->dirty_lock);
+    
+    if (cache_dirty_count() > cache_dirty_high()) sema_up(&write_behind_sema);
+}
+
+/* E must be held exclusively, or shared by the flusher */
+static void
+mark_clean(struct cache_entry *e)
+{
+    struct cache_shard *shard = entry_to_shard(e);
+    if (!e->dirty) return;
     
-    e->state = action;
     e->dirty = false;
+    lock_acquire(&shard->dirty_lock);
+    list_remove(&e->dirty_elem);
+    shard->dirty_cnt--;
+    lock_release(&shard->dirty_lock);
+}
+
+static void
+init_cache_block(struct cache_entry* e)
+{
+    e->dirty = false;
+    e->queue = TWOQ_NONE;
+    e->log = LOG_NONE;
     
-    e->sector_no = block_sector;
-    e->read_ref = 0;
-    e->write_ref = 0;
+    e->sector_no = (block_sector_t) -1;
+    rwlock_init(&e->rw);
+}
+
+static unsigned
+cache_hash_func(const struct hash_elem *e, void *aux UNUSED)
+{
+    struct cache_entry *ce = hash_entry(e, struct cache_entry, hash_elem);
+    return hash_int(ce->sector_no);
+}
+
+static bool
+cache_less_func(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+    struct cache_entry *ce_a = hash_entry(a, struct cache_entry, hash_elem);
+    struct cache_entry *ce_b = hash_entry(b, struct cache_entry, hash_elem);
+    return ce_a->sector_no < ce_b->sector_no;
+}
+
+/* shard lock must be held, since shard map is updated here,
+   and E must be held exclusively */
+static void
+setup_cache_block(struct cache_shard *shard, struct cache_entry *e,
+                  block_sector_t block_sector)
+{
+    ASSERT(lock_held_by_current_thread(&shard->lock));
+    ASSERT(rwlock_held_for_write(&e->rw));
+    
+    mark_clean(e);
+    set_log(e, LOG_NONE);
     
-    if (action == CACHE_READ) e->read_ref++;
-    if (action == CACHE_WRITE) e->write_ref++;
-    if (!lock_held) lock_release(&e->block_lock);
+    if (e->sector_no != (block_sector_t) -1) hash_delete(&shard->map, &e->hash_elem);
+    e->sector_no = block_sector;
+    if (e->sector_no != (block_sector_t) -1) hash_insert(&shard->map, &e->hash_elem);
 }
 
 static void
-cache_write_back(void)
+cache_write_back(void *aux UNUSED)
 {
     while(true){
-        cache_flush();
+        /* commit metadata, free map included, then write back what
+           the journal does not hold back */
+        journal_commit();
+        cache_write_behind(0, false);
+        cache_resize();
         timer_sleep(100);
     }
 }
 
+static void
+cache_write_behind_routine(void *aux UNUSED)
+{
+    while(true){
+        sema_down(&write_behind_sema);
+        if (cache_dirty_count() > cache_dirty_low()) cache_write_behind(cache_dirty_low(), true);
+    }
+}
+
+static void
+cache_read_ahead(void *aux UNUSED)
+{
+    block_sector_t sector;
+    while(true){
+        lock_acquire(&prefetch_lock);
+        while (prefetch_cnt == 0) cond_wait(&prefetch_cv, &prefetch_lock);
+        sector = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % CACHE_PREFETCH_QUEUE;
+        prefetch_cnt--;
+        lock_release(&prefetch_lock);
+    
+        /* bring sector in and drop the read reference right away */
+        cache_unpin(cache_pin_read(sector), false);
+    }
+}
+
+/* Queues SECTOR to be read into the cache in the background. */
+void
+cache_prefetch(block_sector_t sector)
+{
+    lock_acquire(&prefetch_lock);
+    if (prefetch_cnt < CACHE_PREFETCH_QUEUE) {
+        prefetch_queue[(prefetch_head + prefetch_cnt) % CACHE_PREFETCH_QUEUE] = sector;
+        prefetch_cnt++;
+        cond_signal(&prefetch_cv, &prefetch_lock);
+    }
+    lock_release(&prefetch_lock);
+}
+
 void
 cache_init(void)
 {
-    list_init (&cache_in_use);
-    clock_iter = NULL;
-    
-    lock_init(&cache_lock);
+    /* one cache page per physical frame at most */
+    size_t table_pages = DIV_ROUND_UP(init_ram_pages * sizeof *cache_page_table, PGSIZE);
+    cache_page_table = palloc_get_multiple(PAL_ASSERT | PAL_ZERO, table_pages);
+    list_init(&cache_pages);
+    list_init(&retired_pages);
+    lock_init(&resize_lock);
+    cache_nblocks = 0;
     
-    /* initialize cach table */
-    cache_table = malloc(sizeof(struct cache_entry) * CACHE_NBLOCKS);
-    for (size_t i = 0; i < CACHE_NBLOCKS; i++) init_cache_block(cache_table+i);
+    /* initialize shards */
+    size_t ghost_cap = (cache_max_nblocks + CACHE_OVERDRAFT_NBLOCKS) / CACHE_NSHARDS / 2 + 1;
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) {
+        struct cache_shard *shard = cache_shards + i;
+        lock_init(&shard->lock);
+        hash_init(&shard->map, cache_hash_func, cache_less_func, NULL);
+        list_init(&shard->in_use);
+        shard->clock_iter = NULL;
+        list_init(&shard->a1in);
+        shard->a1in_cnt = 0;
+        shard->ghost = malloc(ghost_cap * sizeof *shard->ghost);
+        shard->ghost_cnt = 0;
+        list_init(&shard->free);
+        shard->nblocks = 0;
+        lock_init(&shard->dirty_lock);
+        list_init(&shard->dirty);
+        shard->dirty_cnt = 0;
+        shard->log_cnt = 0;
+    }
     
     /* initialize cache */
-    size_t cache_pages = DIV_ROUND_UP(BLOCK_SECTOR_SIZE * CACHE_NBLOCKS, PGSIZE);
-    cache_base = palloc_get_multiple(PAL_ZERO, cache_pages);
+    if (cache_grow(CACHE_NBLOCKS / CACHE_PAGE_NBLOCKS, false) == 0)
+        PANIC("no memory for buffer cache");
+    
+    sema_init(&write_behind_sema, 0);
+    lock_init(&flush_lock);
+    flush_batch = malloc((cache_max_nblocks + CACHE_OVERDRAFT_NBLOCKS) * sizeof *flush_batch);
+    lock_init(&run_lock);
+    run_buf = palloc_get_page(PAL_ASSERT);
     
-    /* initialize cache bitmap */
-    size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (CACHE_NBLOCKS), PGSIZE);
-    void *used_map_base = palloc_get_multiple(PAL_ZERO, bm_pages);
-    used_map = bitmap_create_in_buf (CACHE_NBLOCKS, used_map_base, bm_pages * PGSIZE);
+    prefetch_head = 0;
+    prefetch_cnt = 0;
+    lock_init(&prefetch_lock);
+    cond_init(&prefetch_cv);
     
-    cache_flush_thread = thread_create ("cache_flush_routine", PRI_DEFAULT, cache_write_back, NULL);
+    thread_create ("cache_flush_routine", PRI_DEFAULT, cache_write_back, NULL);
+    thread_create ("cache_write_behind", PRI_DEFAULT, cache_write_behind_routine, NULL);
+    thread_create ("cache_read_ahead", PRI_DEFAULT, cache_read_ahead, NULL);
 }
 
-static size_t
-compute_cache_index(void *cache)
+/* Sets the most sectors the cache may grow to. Must be called
+   before cache_init(). */
+void
+cache_set_max(size_t nblocks)
 {
-    ASSERT( (cache - cache_base) % BLOCK_SECTOR_SIZE == 0);
-    return (cache - cache_base) / BLOCK_SECTOR_SIZE;
+    nblocks -= nblocks % CACHE_PAGE_NBLOCKS;
+    cache_max_nblocks = nblocks > CACHE_NBLOCKS ? nblocks : CACHE_NBLOCKS;
 }
 
+static inline size_t
+kpage_to_frame(void *kpage)
+{
+    ASSERT(pg_ofs(kpage) == 0);
+    ASSERT((size_t)vtop(kpage)/PGSIZE < init_ram_pages);
+    return (size_t)vtop(kpage)/PGSIZE;
+}
 
-static void *
-cache_fetch_sector(block_sector_t block, size_t cache_index, enum cache_action action)
+/* Adds up to PAGE_CNT pages to the cache, as far as the ceiling,
+   raised by CACHE_OVERDRAFT_NBLOCKS if OVERDRAFT, and the kernel pool
+   allow. Returns the number of pages added. */
+static size_t
+cache_grow(size_t page_cnt, bool overdraft)
 {
-    struct cache_entry* e = cache_table + cache_index;
-            
-    int count = 0;
-    lock_acquire(&e->block_lock);
-    if (e->sector_no != block) {
-        cache_index = -1;
-        lock_release(&e->block_lock);
-        return NULL;
-    } else {
-        if (action == CACHE_WRITE) {
-            e->write_ref++;
-            if (e->state != NOOP || e->write_ref > 1) {
-                while (e->state != NOOP) {
-//                    printf("cond_wait write: 0x%08x, count: %d, threadname: %s\n", cache_base+cache_index*BLOCK_SECTOR_SIZE, count, thread_name());
-                    cond_wait(&e->write_cv, &e->block_lock);
-                    count++;
-                }
-            }
-        } else if (action == CACHE_READ) {
-            e->read_ref++;
-            if (e->write_ref > 0) {
-                do {
-//                    printf("cond_wait read: 0x%08x, count: %d, threadname: %s\n", cache_base+cache_index*BLOCK_SECTOR_SIZE, count, thread_name());
-                    cond_wait(&e->read_cv, &e->block_lock);
-                    count++;
-                } while(e->state == CACHE_WRITE);
+    size_t ceiling = cache_max_nblocks + (overdraft ? CACHE_OVERDRAFT_NBLOCKS : 0);
+    size_t added = 0;
+    
+    lock_acquire(&resize_lock);
+    while (added < page_cnt && cache_nblocks + CACHE_PAGE_NBLOCKS <= ceiling) {
+        struct cache_page *page;
+        void *kpage = palloc_get_page(0);
+        if (kpage == NULL) break;
+    
+        if (!list_empty(&retired_pages)) {
+            page = list_entry(list_pop_front(&retired_pages), struct cache_page, elem);
+        } else {
+            page = malloc(sizeof *page);
+            if (page == NULL) {
+                palloc_free_page(kpage);
+                break;
             }
+            for (size_t i = 0; i < CACHE_PAGE_NBLOCKS; i++) init_cache_block(page->entries + i);
+        }
+        page->kpage = kpage;
+        cache_page_table[kpage_to_frame(kpage)] = page;
+        list_push_back(&cache_pages, &page->elem);
+    
+        for (size_t i = 0; i < CACHE_PAGE_NBLOCKS; i++) {
+            struct cache_entry *e = page->entries + i;
+            struct cache_shard *shard = cache_shards + i % CACHE_NSHARDS;
+            e->data = kpage + i*BLOCK_SECTOR_SIZE;
+            e->shard = shard;
+    
+            lock_acquire(&shard->lock);
+            list_push_back(&shard->free, &e->elem);
+            shard->nblocks++;
+            lock_release(&shard->lock);
         }
-        
-        e->state = action;
-        lock_release(&e->block_lock);
-        return cache_base + cache_index*BLOCK_SECTOR_SIZE;
+        cache_nblocks += CACHE_PAGE_NBLOCKS;
+        added++;
     }
+    lock_release(&resize_lock);
+    
+    return added;
 }
 
+/* Takes entry E out of its shard for shrinking: off the free list,
+   or, if E caches a clean and unreferenced sector, out of the map.
+   Returns false if E is busy or dirty. */
+static bool
+claim_entry(struct cache_entry *e)
+{
+    struct cache_shard *shard = entry_to_shard(e);
+    bool claimed = false;
+    
+    lock_acquire(&shard->lock);
+    if (e->sector_no == (block_sector_t) -1) {
+        /* with the shard lock held, an unmapped entry is free */
+        list_remove(&e->elem);
+        claimed = true;
+    } else if (claim_victim(e, false)) {
+        cache_policy->remove(shard, e);
+        setup_cache_block(shard, e, -1);
+        rwlock_release_write(&e->rw);
+        claimed = true;
+    }
+    if (claimed) shard->nblocks--;
+    lock_release(&shard->lock);
+    
+    return claimed;
+}
 
-void*
-cache_allocate_sector(block_sector_t block, enum cache_action action)
+/* Gives entry E, claimed by claim_entry(), back to its shard. */
+static void
+unclaim_entry(struct cache_entry *e)
+{
+    struct cache_shard *shard = entry_to_shard(e);
+    
+    lock_acquire(&shard->lock);
+    list_push_back(&shard->free, &e->elem);
+    shard->nblocks++;
+    lock_release(&shard->lock);
+}
+
+/* Returns a page of the cache to the kernel pool, unless the cache
+   is at its initial size. Only a page whose blocks are all clean and
+   unreferenced can go; if there is none, the write-behind thread is
+   kicked so a later call can succeed. Returns true if a page was
+   freed. */
+bool
+cache_shrink(void)
 {
-    int cache_index;
-    lock_acquire (&cache_lock);
-    cache_index = cache_lookup(block);
-    lock_release (&cache_lock);
+    struct list_elem *iter;
+    bool shrunk = false;
+    
+    lock_acquire(&resize_lock);
+    if (cache_nblocks <= CACHE_NBLOCKS) {
+        lock_release(&resize_lock);
+        return false;
+    }
+    
+    for (iter = list_rbegin(&cache_pages); iter != list_rend(&cache_pages);
+         iter = list_prev(iter)) {
+        struct cache_page *page = list_entry(iter, struct cache_page, elem);
+        size_t i = 0;
     
-//    printf("cache_allocate_sector ckpt1\n");
+        while (i < CACHE_PAGE_NBLOCKS && claim_entry(page->entries + i)) i++;
+        if (i < CACHE_PAGE_NBLOCKS) {
+            while (i-- > 0) unclaim_entry(page->entries + i);
+            continue;
+        }
     
-    if (cache_index != -1){
-        void *cache = cache_fetch_sector(block, cache_index, action);
-        if (cache != NULL) return cache;
+        list_remove(&page->elem);
+        cache_page_table[kpage_to_frame(page->kpage)] = NULL;
+        palloc_free_page(page->kpage);
+        page->kpage = NULL;
+        list_push_back(&retired_pages, &page->elem);
+        cache_nblocks -= CACHE_PAGE_NBLOCKS;
+        shrunk = true;
+        break;
     }
+    if (!shrunk) sema_up(&write_behind_sema);
+    lock_release(&resize_lock);
     
-//    printf("cache_allocate_sector ckpt2, %d\n", cache_index);
-    /* obtain new block */    
-    return fetch_new_cache_block(block, action);
+    return shrunk;
 }
 
-void
-cache_read(void *cache, void* buffer, size_t offset, size_t size)
+/* Called by the flush thread once a period. Gives a page back when
+   the kernel pool runs low or the cache overdrew its ceiling, and
+   grows the cache when the hit rate
+   over the last period was poor and memory is to spare. */
+static void
+cache_resize(void)
 {
-    /* read data into memory */
-    struct cache_entry* e = cache_table + compute_cache_index(cache);
-    memcpy (buffer, cache + offset, size);
-            
-    lock_acquire(&e->block_lock);
-    ASSERT(e->state == CACHE_READ);
-    ASSERT(e->read_ref > 0);
+    struct cache_stats s;
+    unsigned long long hits, misses;
+    size_t free_pages = palloc_free_cnt(0);
     
-    e->read_ref--;
-    if (e->read_ref == list_size(&e->read_cv)) e->state = NOOP;
+    cache_get_stats(&s);
+    hits = s.hits - resize_hits;
+    misses = s.misses - resize_misses;
+    resize_hits = s.hits;
+    resize_misses = s.misses;
     
-    if (e->write_ref > 0 && e->state == NOOP){
-//        printf("cache_read cond signal write: 0x%08x, thread: %s\n", cache, thread_name());
-        cond_signal(&e->write_cv, &e->block_lock);
+    if (free_pages < CACHE_RESERVE_PAGES || cache_nblocks > cache_max_nblocks) {
+        cache_shrink();
+    } else if (misses >= CACHE_PAGE_NBLOCKS &&
+               misses * CACHE_GROW_MISS_RATE > hits + misses) {
+        size_t pages = DIV_ROUND_UP(misses, CACHE_PAGE_NBLOCKS);
+        if (pages > CACHE_GROW_MAX_PAGES) pages = CACHE_GROW_MAX_PAGES;
+        if (pages > free_pages - CACHE_RESERVE_PAGES) pages = free_pages - CACHE_RESERVE_PAGES;
+        cache_grow(pages, false);
     }
-    else if (e->read_ref > 0 && e->state == NOOP) {
-//        printf("cache_read cond signal read: 0x%08x, thread: %s\n", cache, thread_name());
-        cond_signal(&e->read_cv, &e->block_lock);
+}
+
+/* Returns the entry of the block CACHE points to. */
+static struct cache_entry *
+cache_to_entry(const void *cache)
+{
+    void *kpage = pg_round_down(cache);
+    struct cache_page *page = cache_page_table[kpage_to_frame(kpage)];
+    
+    ASSERT(page != NULL);
+    ASSERT(pg_ofs(cache) % BLOCK_SECTOR_SIZE == 0);
+    return page->entries + pg_ofs(cache) / BLOCK_SECTOR_SIZE;
+}
+
+/* Acquires E in the mode ACTION asks for, timing the wait if it
+   has to sleep. */
+static void
+cache_hold(struct cache_entry *e, enum cache_action action)
+{
+    int64_t start;
+    
+    if (action == CACHE_WRITE) {
+        if (rwlock_try_acquire_write(&e->rw)) return;
+        start = timer_ticks();
+        rwlock_acquire_write(&e->rw);
+    } else {
+        if (rwlock_try_acquire_read(&e->rw)) return;
+        start = timer_ticks();
+        rwlock_acquire_read(&e->rw);
     }
-        
-    lock_release(&e->block_lock);
+    stat_latency(&stats.waits, &stats.wait_ticks, stats.wait_hist, start);
+}
 
+static void
+cache_release(struct cache_entry *e)
+{
+    if (rwlock_held_for_write(&e->rw))
+        rwlock_release_write(&e->rw);
+    else
+        rwlock_release_read(&e->rw);
 }
 
-void
-cache_write(void *cache, void* buffer, size_t offset, size_t size)
+static void *
+cache_fetch_sector(block_sector_t block, struct cache_entry *e, enum cache_action action)
 {
-    /* read data into memory */
-    struct cache_entry* e = cache_table + compute_cache_index(cache);
-    memcpy (cache+offset, buffer, size);
+    cache_hold(e, action);
+    if (e->sector_no != block) {
+        /* evicted since the lookup */
+        cache_release(e);
+        return NULL;
+    }
+    return entry_to_cache(e);
+}
 
-    lock_acquire(&e->block_lock);
-    ASSERT(e->state == CACHE_WRITE);
-    ASSERT(e->write_ref > 0);
+void*
+cache_allocate_sector(block_sector_t block, enum cache_action action)
+{
+    struct cache_shard *shard = sector_to_shard(block);
+    struct cache_entry *e;
+    void *cache = NULL;
     
-    e->write_ref--;
-    e->state = NOOP;
-    e->dirty = true;
-    if (e->read_ref > 0) {
-//        printf("cache_write cond signal read: 0x%08x, thread: %s\n", cache, thread_name());
-        cond_signal(&e->read_cv, &e->block_lock);
+    /* a block about to be overwritten entirely needs no disk read */
+    bool fetch = action != CACHE_WRITE_ALLOCATE;
+    if (action == CACHE_WRITE_ALLOCATE) action = CACHE_WRITE;
+    
+    while (cache == NULL) {
+        lock_acquire (&shard->lock);
+        e = cache_lookup(shard, block);
+        if (e != NULL) cache_policy->touch(shard, e);
+        lock_release (&shard->lock);
+    
+        if (e != NULL) {
+            cache = cache_fetch_sector(block, e, action);
+            if (cache != NULL) stat_add(&stats.hits);
+        } else
+            /* obtain new block */
+            cache = fetch_new_cache_block(block, action, fetch);
     }
-    else if (e->write_ref > 0) {
-//        printf("cache_write cond signal write: 0x%08x, thread: %s\n", cache, thread_name());
-        cond_signal(&e->write_cv, &e->block_lock);
+    
+    return cache;
+}
+
+/* Pins BLOCK in the cache for shared access and returns its
+   contents, which stay valid and unchanged until cache_unpin(). */
+const void *
+cache_pin_read(block_sector_t block)
+{
+    return cache_allocate_sector(block, CACHE_READ);
+}
+
+/* Pins BLOCK in the cache for exclusive access and returns its
+   contents for in-place update until cache_unpin(). */
+void *
+cache_pin_write(block_sector_t block)
+{
+    return cache_allocate_sector(block, CACHE_WRITE);
+}
+
+/* Drops the hold on CACHE taken by cache_allocate_sector() or one
+   of the cache_pin functions. DIRTY marks an exclusive hold as
+   having modified the block. */
+void
+cache_unpin(const void *cache, bool dirty)
+{
+    struct cache_entry* e = cache_to_entry(cache);
+    
+    if (rwlock_held_for_write(&e->rw)) {
+        if (dirty) mark_dirty(e);
+        rwlock_release_write(&e->rw);
+    } else {
+        ASSERT(!dirty);
+        rwlock_release_read(&e->rw);
     }
-    lock_release(&e->block_lock);
+}
 
+void
+cache_read(void *cache, void* buffer, size_t offset, size_t size)
+{
+    /* read data into memory */
+    memcpy (buffer, cache + offset, size);
+    cache_unpin(cache, false);
+}
+
+void
+cache_write(void *cache, void* buffer, size_t offset, size_t size)
+{
+    /* write data into cache */
+    memcpy (cache+offset, buffer, size);
+    cache_unpin(cache, true);
 }
 
 block_sector_t
 cache_index_write(void *cache, uint32_t* sector, size_t offset)
 {
     size_t size = 4;
-    if (*(uint32_t*)(cache+offset) != BITMAP_ERROR) return *(uint32_t*)(cache+offset);
+    block_sector_t sector_read = *(uint32_t*)(cache+offset);
+    if (sector_read != BITMAP_ERROR) {
+        cache_unpin(cache, false);
+        return sector_read;
+    }
     
+    cache_log(cache);
     cache_write(cache, sector, offset, size);
     return *sector;
 }
 
-static int
-cache_lookup(block_sector_t block)
+/* returns the entry caching BLOCK, or NULL.
+   SHARD lock must be held. */
+static struct cache_entry *
+cache_lookup(struct cache_shard *shard, block_sector_t block)
 {
-    int cache_index = -1;
-    for (int i = 0; i < CACHE_NBLOCKS; i++){
-        if ((cache_table+i)->sector_no == block) {
-            cache_index = i;
-            break;
-        }
-    }
+    struct cache_entry key;
+    struct hash_elem *h;
     
-    return cache_index;
+    ASSERT(lock_held_by_current_thread(&shard->lock));
+    
+    key.sector_no = block;
+    h = hash_find(&shard->map, &key.hash_elem);
+    
+    return h != NULL ? hash_entry(h, struct cache_entry, hash_elem) : NULL;
 }
 
+/* Allocates an entry of BLOCK's shard for BLOCK and, if FETCH,
+   reads it from disk, otherwise zeroes it. Returns NULL if another
+   thread cached BLOCK concurrently, in which case the caller should
+   look it up again. */
 static void*
-fetch_new_cache_block(block_sector_t block, enum cache_action action)
+fetch_new_cache_block(block_sector_t block, enum cache_action action, bool fetch)
 {
+    struct cache_shard *shard = sector_to_shard(block);
+    struct cache_entry *e;
     void *cache = NULL;
     
+    lock_acquire (&shard->lock);
+    /* check again if cache has been allocated for the block */
+    if (cache_lookup(shard, block) != NULL) {
+        lock_release (&shard->lock);
+        return NULL;
+    }
+    
     /* obtain new block */
-    size_t cache_index = bitmap_scan_and_flip (used_map, 0, 1, false);
+    if (!list_empty(&shard->free)) {
+        e = list_entry(list_pop_front(&shard->free), struct cache_entry, elem);
+        rwlock_acquire_write(&e->rw);
+    } else {
+        /* victim comes back held exclusively and still mapped, so
+           lookups of the old sector wait until it's written back */
+        e = cache_policy->evict(shard);
+        if (e == NULL) {
+            bool logged = shard->log_cnt > 0;
+            lock_release (&shard->lock);
+            if (!logged) {
+                /* every entry is held, but not for long */
+                thread_yield();
+                return NULL;
+            }
+            /* the shard may be full of blocks waiting for a commit,
+               which in turn waits for the caller's operation, so
+               overdraw rather than wait. journal_begin() commits
+               early enough that the overdraft is not used up; if it
+               is, wait for entries other threads hold after all */
+            if (cache_grow(1, true) == 0) thread_yield();
+            return NULL;
+        }
     
-    if (cache_index == BITMAP_ERROR) {
-        evict_block();
-        cache_index = bitmap_scan_and_flip (used_map, 0, 1, false);
-        ASSERT(cache_index != BITMAP_ERROR);
-    }
-//    printf("fetch_new_cache_block ckpt2\n");
-    lock_acquire (&cache_lock);
-    /* check again if cache has been allocated for the block */
-    int cache_check_idx = cache_lookup(block);
-    while (cache_check_idx != -1) {
-        lock_release (&cache_lock);
-        cache = cache_fetch_sector(block, cache_check_idx, action);
-        if (cache != NULL) {
-            bitmap_set_multiple (used_map, cache_index, 1, false);
-            return cache;
+        if (e->dirty) {
+            lock_release (&shard->lock);
+            block_write (fs_device, e->sector_no, entry_to_cache(e));
+            mark_clean(e);
+            stat_add(&stats.write_backs);
+            lock_acquire (&shard->lock);
+    
+            /* someone cached BLOCK while we were writing back */
+            if (cache_lookup(shard, block) != NULL) {
+                setup_cache_block(shard, e, -1);
+                list_push_back(&shard->free, &e->elem);
+                rwlock_release_write(&e->rw);
+                lock_release (&shard->lock);
+                return NULL;
+            }
         }
-        lock_acquire (&cache_lock);
-        cache_check_idx = cache_lookup(block);
+        stat_add(&stats.evictions);
     }
-//    printf("fetch_new_cache_block ckpt3\n");
+    stat_add(&stats.misses);
+    
     /* update cache state */
-    setup_cache_block(cache_table+cache_index, block, action);
-    list_push_back(&cache_in_use, &(cache_table+cache_index)->elem);
-    lock_release (&cache_lock);
+    setup_cache_block(shard, e, block);
+    cache_policy->insert(shard, e);
+    lock_release (&shard->lock);
+    
+    /* lookups of BLOCK wait on the exclusive hold until data arrives */
+    cache = entry_to_cache(e);
+    if (fetch)
+        block_read (fs_device, e->sector_no, cache);
+    else
+        memset (cache, 0, BLOCK_SECTOR_SIZE);
+    if (action != CACHE_WRITE) rwlock_downgrade(&e->rw);
     
-    cache = cache_base + BLOCK_SECTOR_SIZE*cache_index;
-    block_read (fs_device, (cache_table+cache_index)->sector_no, cache);
-
     return cache;
 }
 
 
+/* Sets the replacement policy to the one called NAME. Must be
+   called before cache_init(). Returns false if there is no such
+   policy. */
+bool
+cache_set_policy(const char *name)
+{
+    if (name == NULL) return false;
+    if (!strcmp(name, clock_policy.name)) cache_policy = &clock_policy;
+    else if (!strcmp(name, twoq_policy.name)) cache_policy = &twoq_policy;
+    else return false;
+    return true;
+}
+
+/* Returns true, with E held exclusively, if E can be evicted: it
+   is not held, and clean unless ALLOW_DIRTY and not waiting for
+   the journal. */
+static bool
+claim_victim(struct cache_entry *e, bool allow_dirty)
+{
+    if (e->dirty && (!allow_dirty || awaits_log(e))) return false;
+    if (!rwlock_try_acquire_write(&e->rw)) return false;
+    if (!e->dirty || (allow_dirty && !awaits_log(e))) return true;
+    rwlock_release_write(&e->rw);
+    return false;
+}
+
 static void
-evict_block()
+clock_insert(struct cache_shard *shard, struct cache_entry *e)
 {
-    bool dirty = false;
-    block_sector_t sector_no;
-    
-    struct cache_entry *e;
-    /* acquire block to evict */
-    lock_acquire (&cache_lock);
-    ASSERT(!list_empty(&cache_in_use));
+    list_push_back(&shard->in_use, &e->elem);
+}
+
+static void
+clock_touch(struct cache_shard *shard UNUSED, struct cache_entry *e UNUSED)
+{
+}
+
+static void
+clock_remove(struct cache_shard *shard, struct cache_entry *e)
+{
+    if (shard->clock_iter == &e->elem)
+        shard->clock_iter = list_remove(&e->elem);
+    else
+        list_remove(&e->elem);
+}
 
+/* Clock over all blocks of SHARD. A dirty block is only taken after
+   a full pass found no clean one, which also kicks the write-behind
+   thread. */
+static struct cache_entry *
+clock_evict(struct cache_shard *shard)
+{
+    struct cache_entry *e;
+    
+    ASSERT(lock_held_by_current_thread(&shard->lock));
+    if (list_empty(&shard->in_use)) return NULL;
+    
     int counter = 0;
     while (true) {
-        if (clock_iter == NULL || clock_iter == list_end(&cache_in_use)) clock_iter = list_front(&cache_in_use);
-                    
-        e = list_entry(clock_iter, struct cache_entry, elem);
-        if ( e->read_ref == 0 && e->write_ref == 0 &&
-            (!e->dirty || counter > CACHE_NBLOCKS)) {
-            if (lock_try_acquire(&e->block_lock)){
-                if (e->read_ref == 0 && e->write_ref == 0 &&
-                    (!e->dirty || counter > CACHE_NBLOCKS) ) break;
-                lock_release(&e->block_lock);
-            }
+        if (shard->clock_iter == NULL || shard->clock_iter == list_end(&shard->in_use))
+            shard->clock_iter = list_front(&shard->in_use);
+    
+        e = list_entry(shard->clock_iter, struct cache_entry, elem);
+        if (claim_victim(e, counter > (int) shard->nblocks)) break;
+        if (++counter == (int) shard->nblocks) sema_up(&write_behind_sema);
+        if (counter > 3 * (int) shard->nblocks) return NULL;
+        shard->clock_iter = list_next(shard->clock_iter);
+    }
+    shard->clock_iter = list_remove(shard->clock_iter);
+    
+    return e;
+}
+
+/* 2Q (Johnson and Shasha). A block enters a1in, a FIFO, on its first
+   miss, and hits there do not promote it, so a streaming read only
+   ever recycles a1in. Blocks evicted from a1in are remembered in the
+   ghost list A1out; a miss on a remembered sector means the block is
+   reused over a longer interval, and it goes to Am, an LRU list. Hot
+   metadata such as inode and index sectors ends up in Am and stays
+   resident across large sequential reads. */
+#define TWOQ_KIN(SHARD)  ((SHARD)->nblocks / 4 > 0 ? (SHARD)->nblocks / 4 : 1)
+#define TWOQ_KOUT(SHARD) ((SHARD)->nblocks / 2 > 0 ? (SHARD)->nblocks / 2 : 1)
+
+
+/* Removes SECTOR from the ghost list of SHARD. Returns true if it
+   was there. */
+static bool
+ghost_remove(struct cache_shard *shard, block_sector_t sector)
+{
+    for (size_t i = 0; i < shard->ghost_cnt; i++)
+        if (shard->ghost[i] == sector) {
+            memmove(shard->ghost + i, shard->ghost + i + 1,
+                    (shard->ghost_cnt - i - 1) * sizeof *shard->ghost);
+            shard->ghost_cnt--;
+            return true;
+        }
+    return false;
+}
+
+static void
+ghost_add(struct cache_shard *shard, block_sector_t sector)
+{
+    while (shard->ghost_cnt >= TWOQ_KOUT(shard)) {
+        memmove(shard->ghost, shard->ghost + 1,
+                (shard->ghost_cnt - 1) * sizeof *shard->ghost);
+        shard->ghost_cnt--;
+    }
+    shard->ghost[shard->ghost_cnt++] = sector;
+}
+
+static void
+twoq_insert(struct cache_shard *shard, struct cache_entry *e)
+{
+    if (ghost_remove(shard, e->sector_no)) {
+        e->queue = TWOQ_AM;
+        list_push_front(&shard->in_use, &e->elem);
+    } else {
+        e->queue = TWOQ_A1IN;
+        list_push_front(&shard->a1in, &e->elem);
+        shard->a1in_cnt++;
+    }
+}
+
+static void
+twoq_touch(struct cache_shard *shard, struct cache_entry *e)
+{
+    if (e->queue == TWOQ_AM) {
+        list_remove(&e->elem);
+        list_push_front(&shard->in_use, &e->elem);
+    }
+}
+
+static void
+twoq_remove(struct cache_shard *shard, struct cache_entry *e)
+{
+    list_remove(&e->elem);
+    if (e->queue == TWOQ_A1IN) shard->a1in_cnt--;
+    e->queue = TWOQ_NONE;
+}
+
+/* Returns the oldest block of LIST that claim_victim() accepts. */
+static struct cache_entry *
+twoq_scan(struct list *list, bool allow_dirty)
+{
+    struct list_elem *iter;
+    for (iter = list_rbegin(list); iter != list_rend(list); iter = list_prev(iter)) {
+        struct cache_entry *e = list_entry(iter, struct cache_entry, elem);
+        if (claim_victim(e, allow_dirty)) return e;
+    }
+    return NULL;
+}
+
+/* Takes from a1in while it is over its share of the shard, from Am
+   otherwise, and falls back to the other list when all blocks of the
+   preferred one are busy. Dirty blocks are only taken when no clean
+   block is left, which also kicks the write-behind thread. */
+static struct cache_entry *
+twoq_evict(struct cache_shard *shard)
+{
+    struct list *first, *second;
+    struct cache_entry *e = NULL;
+    
+    ASSERT(lock_held_by_current_thread(&shard->lock));
+    
+    first = shard->a1in_cnt > TWOQ_KIN(shard) ? &shard->a1in : &shard->in_use;
+    second = first == &shard->a1in ? &shard->in_use : &shard->a1in;
+    
+    for (int allow_dirty = 0; allow_dirty <= 1 && e == NULL; allow_dirty++) {
+        if (allow_dirty) sema_up(&write_behind_sema);
+        e = twoq_scan(first, allow_dirty);
+        if (e == NULL) e = twoq_scan(second, allow_dirty);
+    }
+    if (e == NULL) return NULL;
+    
+    list_remove(&e->elem);
+    if (e->queue == TWOQ_A1IN) {
+        shard->a1in_cnt--;
+        ghost_add(shard, e->sector_no);
+    }
+    e->queue = TWOQ_NONE;
+    return e;
+}
+
+static int
+compare_sector(const void *a_, const void *b_)
+{
+    const struct cache_entry *a = *(struct cache_entry * const *) a_;
+    const struct cache_entry *b = *(struct cache_entry * const *) b_;
+    return a->sector_no < b->sector_no ? -1 : a->sector_no > b->sector_no;
+}
+
+/* Writes the N blocks in HELD, which hold consecutive sectors,
+   are held shared by the caller and were copied into run_buf, to
+   disk as one request. Marks them clean and releases them.
+   Returns N. */
+static size_t
+cache_write_held(struct cache_entry **held, size_t n)
+{
+    if (n == 0) return 0;
+    block_write_multiple (fs_device, held[0]->sector_no, n, run_buf);
+    for (size_t i = 0; i < n; i++) {
+        mark_clean(held[i]);
+        held[i]->log = LOG_NONE;
+        stat_add(&stats.write_backs);
+        rwlock_release_read(&held[i]->rw);
+    }
+    return n;
+}
+
+/* Writes back a run of CNT blocks holding consecutive sectors, up
+   to a page of them per disk request, holding each shared so
+   readers carry on. Blocks cleaned or re-targeted since they were
+   picked are skipped, as are blocks waiting for the journal and,
+   unless LOGGED, committed ones. Returns the number of blocks
+   written. */
+static size_t
+cache_write_run(struct cache_entry **run, size_t cnt, bool logged)
+{
+    struct cache_entry *held[CACHE_PAGE_NBLOCKS];
+    size_t written = 0, n = 0;
+    
+    lock_acquire(&run_lock);
+    for (size_t i = 0; i < cnt; i++) {
+        struct cache_entry *e = run[i];
+    
+        /* a writer of E may be waiting for one of the held blocks,
+           so only wait for E while holding none */
+        if (n == CACHE_PAGE_NBLOCKS || (n > 0 && !rwlock_try_acquire_read(&e->rw))) {
+            written += cache_write_held(held, n);
+            n = 0;
         }
-        counter++;
-        clock_iter = list_next(clock_iter);
+        if (n == 0) rwlock_acquire_read(&e->rw);
+    
+        if (!e->dirty || e->sector_no == (block_sector_t) -1 || awaits_log(e)
+            || (!logged && e->log != LOG_NONE)) {
+            rwlock_release_read(&e->rw);
+            continue;
+        }
+        if (n > 0 && e->sector_no != held[n-1]->sector_no + 1) {
+            written += cache_write_held(held, n);
+            n = 0;
+        }
+        memcpy((uint8_t *) run_buf + n * BLOCK_SECTOR_SIZE, entry_to_cache(e), BLOCK_SECTOR_SIZE);
+        held[n++] = e;
     }
-    clock_iter = list_remove(clock_iter);
-    lock_release (&cache_lock);
+    written += cache_write_held(held, n);
+    lock_release(&run_lock);
+    return written;
+}
 
-    /* evict block */
-    /* write to disk if dirty */
-    size_t cache_index = e - cache_table;
-    dirty = e->dirty;
-    sector_no = e->sector_no;
-    setup_cache_block(e, -1, NOOP);
-    lock_release(&e->block_lock);
+/* Writes dirty blocks back in ascending sector order, a run of
+   consecutive sectors at a time, until no more than TARGET blocks
+   are dirty. Blocks the journal has committed are only written if
+   LOGGED. */
+static void
+cache_write_behind(size_t target, bool logged)
+{
+    size_t cnt = 0, written = 0;
     
-    if (dirty) block_write (fs_device, sector_no, cache_base+cache_index*BLOCK_SECTOR_SIZE);
-    memset(cache_base+cache_index*BLOCK_SECTOR_SIZE, 0, BLOCK_SECTOR_SIZE); /* set memory to all zeros*/
+    lock_acquire(&flush_lock);
+    int64_t start = timer_ticks();
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) {
+        struct cache_shard *shard = cache_shards + i;
+        struct list_elem *iter;
     
-    /* free bitmap */
-    ASSERT (bitmap_all (used_map, cache_index, 1));
-    bitmap_set_multiple (used_map, cache_index, 1, false);
+        lock_acquire(&shard->dirty_lock);
+        for (iter = list_begin(&shard->dirty); iter != list_end(&shard->dirty);
+             iter = list_next(iter))
+            flush_batch[cnt++] = list_entry(iter, struct cache_entry, dirty_elem);
+        lock_release(&shard->dirty_lock);
+    }
+    qsort(flush_batch, cnt, sizeof *flush_batch, compare_sector);
     
+    size_t i = 0;
+    while (i < cnt && cache_dirty_count() > target) {
+        size_t j = i + 1;
+        while (j < cnt && flush_batch[j]->sector_no == flush_batch[j-1]->sector_no + 1) j++;
+        written += cache_write_run(flush_batch + i, j - i, logged);
+        i = j;
+    }
+    if (written > 0) stat_latency(&stats.flushes, &stats.flush_ticks, stats.flush_hist, start);
+    lock_release(&flush_lock);
 }
 
+/* Writes back every dirty block but those waiting for the
+   journal. */
 void
 cache_flush(void)
 {
-    lock_acquire (&cache_lock);
-    if (!list_empty(&cache_in_use)){
+    cache_write_behind(0, true);
+}
+
+/* Writes back the dirty blocks among the CNT sectors from SECTOR,
+   but those waiting for the journal, and leaves the rest of the
+   cache alone. */
+void
+cache_sync(block_sector_t sector, size_t cnt)
+{
+    struct cache_entry *run[CACHE_PAGE_NBLOCKS];
+    size_t n = 0;
+    
+    for (block_sector_t s = sector; s < sector + cnt; s++) {
+        struct cache_shard *shard = sector_to_shard(s);
         struct cache_entry *e;
-        struct list_elem *iter = list_front(&cache_in_use);
-        while(iter != list_end(&cache_in_use)){
-            e = list_entry(iter, struct cache_entry, elem);
-            if (lock_try_acquire(&e->block_lock)){
-                if (e->dirty) {
-                    block_write (fs_device, e->sector_no, cache_base+(e - cache_table)*BLOCK_SECTOR_SIZE);
-                    e->dirty = false;
-                }
-                lock_release(&e->block_lock);
+    
+        lock_acquire(&shard->lock);
+        e = cache_lookup(shard, s);
+        lock_release(&shard->lock);
+        if (e != NULL && e->dirty) run[n++] = e;
+        if (n == CACHE_PAGE_NBLOCKS || (n > 0 && s + 1 == sector + cnt)) {
+            cache_write_run(run, n, true);
+            n = 0;
+        }
+    }
+}
+
+/* Drops the cached copies of the CNT sectors from SECTOR, which
+   are being freed, so that nothing written to them before is logged
+   or written back. A block someone holds stays cached but no longer
+   waits for the journal. */
+void
+cache_forget(block_sector_t sector, size_t cnt)
+{
+    for (block_sector_t s = sector; s < sector + cnt; s++) {
+        struct cache_shard *shard = sector_to_shard(s);
+        struct cache_entry *e;
+    
+        lock_acquire(&shard->lock);
+        e = cache_lookup(shard, s);
+        if (e != NULL && rwlock_try_acquire_write(&e->rw)) {
+            cache_policy->remove(shard, e);
+            setup_cache_block(shard, e, -1);
+            list_push_back(&shard->free, &e->elem);
+            rwlock_release_write(&e->rw);
+        } else if (e != NULL)
+            set_log(e, LOG_NONE);
+        lock_release(&shard->lock);
+    }
+}
+
+/* Makes the journal hold metadata blocks changed through
+   cache_log() from now on if LOGGING, or stop doing so. */
+void
+cache_set_logging(bool logging)
+{
+    cache_logging = logging;
+}
+
+/* Marks the block CACHE, held exclusively, as metadata whose change
+   must be committed to the journal before it is written back. Call
+   before unpinning it dirty. */
+void
+cache_log(void *cache)
+{
+    struct cache_entry *e = cache_to_entry(cache);
+    
+    ASSERT(rwlock_held_for_write(&e->rw));
+    if (cache_logging) set_log(e, LOG_PENDING);
+}
+
+/* Returns the number of blocks waiting for the journal. */
+size_t
+cache_log_count(void)
+{
+    size_t cnt = 0;
+    
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) {
+        struct cache_shard *shard = cache_shards + i;
+        lock_acquire(&shard->dirty_lock);
+        cnt += shard->log_cnt;
+        lock_release(&shard->dirty_lock);
+    }
+    return cnt;
+}
+
+/* Returns true if some shard has half of its entries waiting for
+   the journal, so that the journal should commit before another
+   operation starts. */
+bool
+cache_log_crowded(void)
+{
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) {
+        struct cache_shard *shard = cache_shards + i;
+        if (shard->log_cnt * 2 >= shard->nblocks) return true;
+    }
+    return false;
+}
+
+/* Hands up to MAX dirty blocks changed through cache_log() since
+   they were last logged to LOG, in ascending sector order, each
+   held shared. LOG returns false for a block that need not be
+   logged after all, which is then written back like any other.
+   Returns the number of blocks LOG took; they stay unwritten until
+   cache_log_done(). */
+size_t
+cache_log_pending(size_t max, bool (*log) (block_sector_t, const void *))
+{
+    size_t cnt = 0, logged = 0;
+    
+    lock_acquire(&flush_lock);
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) {
+        struct cache_shard *shard = cache_shards + i;
+        struct list_elem *iter;
+    
+        lock_acquire(&shard->dirty_lock);
+        for (iter = list_begin(&shard->dirty); iter != list_end(&shard->dirty);
+             iter = list_next(iter)) {
+            struct cache_entry *e = list_entry(iter, struct cache_entry, dirty_elem);
+            if (e->log == LOG_PENDING) flush_batch[cnt++] = e;
+        }
+        lock_release(&shard->dirty_lock);
+    }
+    qsort(flush_batch, cnt, sizeof *flush_batch, compare_sector);
+    
+    for (size_t i = 0; i < cnt && logged < max; i++) {
+        struct cache_entry *e = flush_batch[i];
+        rwlock_acquire_read(&e->rw);
+        if (e->log == LOG_PENDING && e->sector_no != (block_sector_t) -1) {
+            if (log(e->sector_no, entry_to_cache(e))) {
+                e->log = LOG_WRITING;
+                logged++;
+            } else
+                set_log(e, LOG_NONE);
+        }
+        rwlock_release_read(&e->rw);
+    }
+    lock_release(&flush_lock);
+    
+    return logged;
+}
+
+/* Lets blocks taken by cache_log_pending() be written back, now
+   that the journal has committed them. */
+void
+cache_log_done(void)
+{
+    for (size_t i = 0; i < CACHE_NSHARDS; i++) {
+        struct cache_shard *shard = cache_shards + i;
+        struct list_elem *iter;
+    
+        lock_acquire(&shard->dirty_lock);
+        for (iter = list_begin(&shard->dirty); iter != list_end(&shard->dirty);
+             iter = list_next(iter)) {
+            struct cache_entry *e = list_entry(iter, struct cache_entry, dirty_elem);
+            if (e->log == LOG_WRITING) {
+                e->log = LOG_DONE;
+                shard->log_cnt--;
             }
-            iter = list_next(iter);
         }
+        lock_release(&shard->dirty_lock);
     }
-    lock_release (&cache_lock);
 }
 
+/* Copies the cache statistics into OUT. */
+void
+cache_get_stats(struct cache_stats *out)
+{
+    enum intr_level old_level = intr_disable();
+    *out = stats;
+    intr_set_level(old_level);
+    out->blocks = cache_nblocks;
+}
 
+static void
+print_histogram(const char *name, const unsigned long long *hist)
+{
+    printf("Cache %s ticks:", name);
+    for (size_t i = 0; i + 1 < CACHESTAT_BUCKETS; i++)
+        printf(" <%d: %llu,", 1 << i, hist[i]);
+    printf(" more: %llu\n", hist[CACHESTAT_BUCKETS - 1]);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats(void)
+{
+    struct cache_stats s;
+    
+    cache_get_stats(&s);
+    printf("Cache: %llu blocks, %llu hits, %llu misses, %llu evictions, %llu write-backs\n",
+           s.blocks, s.hits, s.misses, s.evictions, s.write_backs);
+    printf("Cache: %llu flushes in %llu ticks, %llu waits for %llu ticks\n",
+           s.flushes, s.flush_ticks, s.waits, s.wait_ticks);
+    print_histogram("flush", s.flush_hist);
+    print_histogram("wait", s.wait_hist);
+}
@@ -8,25 +8,53 @@
 #ifndef cache_h
 #define cache_h
 
+#include <stdbool.h>
 #include "devices/block.h"
 
-#define CACHE_NBLOCKS 64
+#define CACHE_NBLOCKS 64          /* Initial and smallest size, in sectors. */
+#define CACHE_MAX_NBLOCKS 1024    /* Default for the largest size. */
+#define CACHE_NSHARDS 8
+#define CACHE_PREFETCH_QUEUE 32
 
 enum cache_action
 {
     NOOP,
     CACHE_READ,
-    CACHE_WRITE
+    CACHE_WRITE,
+    CACHE_WRITE_ALLOCATE    /* CACHE_WRITE of a whole sector: on a miss the
+                               block is zeroed instead of read from disk */
 };
 
 void cache_init(void);
 
 void *cache_allocate_sector(block_sector_t, enum cache_action);
 
+const void *cache_pin_read(block_sector_t);
+void *cache_pin_write(block_sector_t);
+void cache_unpin(const void *, bool);
+
 void cache_read(void *, void*, size_t, size_t);
 void cache_write(void *, void*, size_t, size_t);
 block_sector_t cache_index_write(void *, uint32_t*, size_t);
 
+void cache_prefetch(block_sector_t);
+bool cache_set_policy(const char *);
+void cache_set_max(size_t);
+bool cache_shrink(void);
+
 void cache_flush(void);
+void cache_sync(block_sector_t, size_t);
+void cache_forget(block_sector_t, size_t);
+
+void cache_set_logging(bool);
+void cache_log(void *);
+size_t cache_log_count(void);
+bool cache_log_crowded(void);
+size_t cache_log_pending(size_t, bool (*) (block_sector_t, const void *));
+void cache_log_done(void);
+
+struct cache_stats;
+void cache_get_stats(struct cache_stats *);
+void cache_print_stats(void);
 
 #endif /* cache_h */
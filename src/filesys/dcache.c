@@ -0,0 +1,154 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* A cached directory entry: NAME in the directory whose inode is
+   in sector PARENT.  A negative entry records that there is no
+   such name. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru or free list. */
+    block_sector_t parent;              /* Directory's inode sector. */
+    block_sector_t child;               /* Named inode's sector, or -1. */
+    char name[NAME_MAX + 1];            /* Null terminated name. */
+  };
+
+static struct dentry pool[DCACHE_SIZE];
+static struct hash dentries;            /* Keyed by (parent, name). */
+static struct list lru;                 /* Least recently used first. */
+static struct list free_dentries;       /* Unused members of pool. */
+static struct lock dcache_lock;         /* Guards the members above. */
+
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  hash_init (&dentries, dentry_hash, dentry_less, NULL);
+  list_init (&lru);
+  list_init (&free_dentries);
+  lock_init (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    list_push_back (&free_dentries, &pool[i].lru_elem);
+}
+
+/* Returns the cached entry for NAME in PARENT, or a null pointer. */
+static struct dentry *
+find (block_sector_t parent, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&dcache_lock));
+
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Looks up NAME in the directory whose inode is in sector PARENT.
+   If the cache knows the answer, stores the sector of the named
+   inode into *CHILD, or -1 if there is no such name, and returns
+   true.  Returns false if the directory must be searched. */
+bool
+dcache_lookup (block_sector_t parent, const char *name, block_sector_t *child)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return false;
+
+  lock_acquire (&dcache_lock);
+  d = find (parent, name);
+  if (d != NULL)
+    {
+      *child = d->child;
+      list_remove (&d->lru_elem);
+      list_push_back (&lru, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in sector
+   PARENT names the inode in sector CHILD, or nothing if CHILD is
+   -1.  Replaces what was cached for NAME before. */
+void
+dcache_insert (block_sector_t parent, const char *name, block_sector_t child)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (parent, name);
+  if (d == NULL)
+    {
+      if (list_empty (&free_dentries))
+        {
+          d = list_entry (list_pop_front (&lru), struct dentry, lru_elem);
+          hash_delete (&dentries, &d->hash_elem);
+        }
+      else
+        d = list_entry (list_pop_front (&free_dentries), struct dentry, lru_elem);
+      d->parent = parent;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+    }
+  else
+    list_remove (&d->lru_elem);
+  d->child = child;
+  list_push_back (&lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every entry of the directory whose inode is in sector
+   PARENT.  Called when the sector is given to a new inode, whose
+   entries must not be confused with those of the sector's last
+   owner. */
+void
+dcache_purge_parent (block_sector_t parent)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru); e != list_end (&lru); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->parent == parent)
+        {
+          hash_delete (&dentries, &d->hash_elem);
+          list_remove (&d->lru_elem);
+          list_push_back (&free_dentries, &d->lru_elem);
+        }
+    }
+  lock_release (&dcache_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Number of directory entries the dentry cache holds. */
+#define DCACHE_SIZE 256
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t parent, const char *name,
+                    block_sector_t *child);
+void dcache_insert (block_sector_t parent, const char *name,
+                    block_sector_t child);
+void dcache_purge_parent (block_sector_t parent);
+
+#endif /* filesys/dcache.h */
@@ -2,9 +2,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "devices/block.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A directory. */
 struct dir 
@@ -21,6 +27,458 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* Directories with at least this many entry slots get a name
+   index; smaller ones are scanned.  The index is built in a
+   single dir_add(), so one bigger than DIR_INDEX_BUILD_MAX slots
+   that has none, from before indexes or a full disk, stays
+   without. */
+#define DIR_INDEX_MIN 32
+#define DIR_INDEX_BUILD_MAX (4 * DIR_INDEX_MIN)
+
+/* Identifies a directory index. */
+#define DIR_INDEX_MAGIC 0x44495832
+
+/* Buckets of an outgrown index moved into its successor by each
+   dir_add(). */
+#define INDEX_MOVE_BUCKETS 8
+
+/* A directory's name index is an open-addressed hash table kept
+   in a file of its own, the directory inode's companion inode.
+   Entries stay where they are in the directory file, so readdir
+   positions remain valid however the index changes.  The header
+   takes the first sector; the buckets follow.
+
+   An index about to reach a load factor of 1/2 is replaced by one
+   twice its size, which takes the old one as its own companion.
+   Each later dir_add() moves INDEX_MOVE_BUCKETS buckets over, and
+   lookups and deletions look in both until all are moved, so no
+   operation has to rehash the whole directory. */
+struct dir_index_header
+  {
+    unsigned magic;                     /* DIR_INDEX_MAGIC. */
+    uint32_t bucket_cnt;                /* Number of buckets, a power of 2. */
+    uint32_t used_cnt;                  /* Buckets not empty. */
+    uint32_t free_hint;                 /* No free slot before this one. */
+    uint32_t old_cnt;                   /* Buckets of the old index. */
+    uint32_t moved;                     /* Buckets of it moved so far. */
+  };
+
+#define BUCKETS_OFS BLOCK_SECTOR_SIZE
+
+/* A hash bucket, naming the directory entry in SLOT. */
+struct dir_bucket
+  {
+    uint32_t hash;                      /* Hash of the entry's name. */
+    uint32_t slot;                      /* Entry slot + 1, or one of: */
+#define BUCKET_EMPTY 0                  /* Never used: ends a probe. */
+#define BUCKET_DELETED UINT32_MAX       /* Entry was removed. */
+  };
+
+/* An open directory index. */
+struct dir_index
+  {
+    struct inode *inode;                /* Index file. */
+    struct dir_index_header h;          /* Copy of its header. */
+    struct inode *old;                  /* Index being moved into
+                                           this one, or null. */
+  };
+
+/* In-place iteration over the entries of a directory.  Entries
+   are read straight out of the pinned buffer cache sector; only
+   an entry that straddles two sectors is copied. */
+struct dir_scan
+  {
+    struct inode *inode;                /* Directory being scanned. */
+    off_t ofs;                          /* Offset of next entry. */
+    off_t length;                       /* Directory length. */
+    const uint8_t *sector;              /* Pinned sector, or null. */
+    off_t sector_ofs;                   /* Offset of pinned sector. */
+    struct dir_entry copy;              /* Straddling or hole entry. */
+  };
+
+static void dir_scan_end (struct dir_scan *);
+
+static void
+dir_scan_begin (struct dir_scan *scan, struct inode *inode, off_t ofs)
+{
+  scan->inode = inode;
+  scan->ofs = ofs;
+  scan->length = inode_length (inode);
+  scan->sector = NULL;
+  scan->sector_ofs = -1;
+}
+
+/* Returns the entry at SCAN's position and advances past it, or
+   returns a null pointer at end of directory.  The entry is
+   valid until the next call or dir_scan_end(). */
+static const struct dir_entry *
+dir_scan_next (struct dir_scan *scan)
+{
+  struct dir_entry *e = &scan->copy;
+  off_t ofs = scan->ofs;
+  off_t sector_ofs = ofs - ofs % BLOCK_SECTOR_SIZE;
+
+  if (ofs + (off_t) sizeof *e > scan->length)
+    return NULL;
+  scan->ofs += sizeof *e;
+
+  if (ofs % BLOCK_SECTOR_SIZE + sizeof *e > BLOCK_SECTOR_SIZE)
+    {
+      /* Drop our pin first: a writer queued on the sector would
+         otherwise make us wait on ourselves. */
+      dir_scan_end (scan);
+      scan->sector_ofs = -1;
+      if (inode_read_at (scan->inode, e, sizeof *e, ofs) != sizeof *e)
+        return NULL;
+      return e;
+    }
+
+  if (sector_ofs != scan->sector_ofs)
+    {
+      inode_unpin (scan->sector);
+      scan->sector = inode_pin_read (scan->inode, sector_ofs);
+      scan->sector_ofs = sector_ofs;
+    }
+  if (scan->sector == NULL)
+    {
+      /* Sparse directory block reads as free entries. */
+      memset (e, 0, sizeof *e);
+      return e;
+    }
+  return (const struct dir_entry *) (scan->sector + ofs % BLOCK_SECTOR_SIZE);
+}
+
+static void
+dir_scan_end (struct dir_scan *scan)
+{
+  inode_unpin (scan->sector);
+  scan->sector = NULL;
+}
+
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  dcache_init ();
+}
+
+/* Opens the index file in SECTOR, or returns a null pointer if
+   SECTOR is -1 or the file cannot be opened. */
+static struct inode *
+index_open_inode (block_sector_t sector)
+{
+  struct inode *inode;
+
+  if (sector == (block_sector_t) -1)
+    return NULL;
+  inode = inode_open (sector);
+  if (inode != NULL)
+    inode_set_metadata (inode);
+  return inode;
+}
+
+/* Opens DIR's name index into IX.  Returns false if DIR has none. */
+static bool
+index_open (const struct dir *dir, struct dir_index *ix)
+{
+  ix->inode = index_open_inode (inode_get_aux (dir->inode));
+  if (ix->inode == NULL)
+    return false;
+  ix->old = index_open_inode (inode_get_aux (ix->inode));
+  if (inode_read_at (ix->inode, &ix->h, sizeof ix->h, 0) != sizeof ix->h
+      || ix->h.magic != DIR_INDEX_MAGIC
+      || (ix->old == NULL && inode_get_aux (ix->inode) != (block_sector_t) -1))
+    {
+      inode_close (ix->old);
+      inode_close (ix->inode);
+      return false;
+    }
+  return true;
+}
+
+/* Closes IX, first writing back its header if WRITE_HEADER. */
+static void
+index_close (struct dir_index *ix, bool write_header)
+{
+  if (write_header)
+    inode_write_at (ix->inode, &ix->h, sizeof ix->h, 0);
+  inode_close (ix->old);
+  inode_close (ix->inode);
+}
+
+/* Reads bucket B of index file INODE into *BP. */
+static void
+index_read_bucket (struct inode *inode, uint32_t b, struct dir_bucket *bp)
+{
+  if (inode_read_at (inode, bp, sizeof *bp, BUCKETS_OFS + b * sizeof *bp)
+      != sizeof *bp)
+    bp->slot = BUCKET_EMPTY;
+}
+
+/* Writes *BP to bucket B of index file INODE. */
+static bool
+index_write_bucket (struct inode *inode, uint32_t b, const struct dir_bucket *bp)
+{
+  return (inode_write_at (inode, bp, sizeof *bp, BUCKETS_OFS + b * sizeof *bp)
+          == sizeof *bp);
+}
+
+/* Looks NAME, whose hash is HASH, up in DIR through the BUCKET_CNT
+   buckets of index file INODE.  On success stores the entry into
+   *EP and its offset into *OFSP if they are non-null, and returns
+   true. */
+static bool
+table_lookup (const struct dir *dir, struct inode *inode, uint32_t bucket_cnt,
+              const char *name, uint32_t hash,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  uint32_t mask = bucket_cnt - 1;
+  uint32_t b;
+
+  for (b = hash & mask; ; b = (b + 1) & mask)
+    {
+      struct dir_bucket bucket;
+      struct dir_entry e;
+      off_t ofs;
+
+      index_read_bucket (inode, b, &bucket);
+      if (bucket.slot == BUCKET_EMPTY)
+        return false;
+      if (bucket.slot == BUCKET_DELETED || bucket.hash != hash)
+        continue;
+
+      ofs = (bucket.slot - 1) * sizeof e;
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e
+          && e.in_use && !strcmp (name, e.name))
+        {
+          if (ep != NULL)
+            *ep = e;
+          if (ofsp != NULL)
+            *ofsp = ofs;
+          return true;
+        }
+    }
+}
+
+/* Looks NAME, whose hash is HASH, up in DIR through its index IX,
+   and the index being moved into it, if any.  On success stores
+   the entry into *EP and its offset into *OFSP if they are
+   non-null, and returns true. */
+static bool
+index_lookup (const struct dir *dir, const struct dir_index *ix,
+              const char *name, uint32_t hash,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  return (table_lookup (dir, ix->inode, ix->h.bucket_cnt, name, hash, ep, ofsp)
+          || (ix->old != NULL
+              && table_lookup (dir, ix->old, ix->h.old_cnt, name, hash,
+                               ep, ofsp)));
+}
+
+/* Records in IX that the entry in SLOT has a name hashing to
+   HASH.  The name must not be in IX already. */
+static bool
+index_insert (struct dir_index *ix, uint32_t hash, uint32_t slot)
+{
+  uint32_t mask = ix->h.bucket_cnt - 1;
+  struct dir_bucket bucket;
+  uint32_t b;
+
+  for (b = hash & mask; ; b = (b + 1) & mask)
+    {
+      index_read_bucket (ix->inode, b, &bucket);
+      if (bucket.slot == BUCKET_EMPTY || bucket.slot == BUCKET_DELETED)
+        break;
+    }
+  if (bucket.slot == BUCKET_EMPTY)
+    ix->h.used_cnt++;
+  bucket.hash = hash;
+  bucket.slot = slot + 1;
+  return index_write_bucket (ix->inode, b, &bucket);
+}
+
+/* Drops the bucket for the entry in SLOT, whose name hashes to
+   HASH, from the BUCKET_CNT buckets of index file INODE. */
+static void
+table_delete (struct inode *inode, uint32_t bucket_cnt,
+              uint32_t hash, uint32_t slot)
+{
+  uint32_t mask = bucket_cnt - 1;
+  struct dir_bucket bucket;
+  uint32_t b;
+
+  for (b = hash & mask; ; b = (b + 1) & mask)
+    {
+      index_read_bucket (inode, b, &bucket);
+      if (bucket.slot == BUCKET_EMPTY)
+        break;
+      if (bucket.slot == slot + 1)
+        {
+          bucket.slot = BUCKET_DELETED;
+          index_write_bucket (inode, b, &bucket);
+          break;
+        }
+    }
+}
+
+/* Drops the bucket for the entry in SLOT, whose name hashes to
+   HASH, from IX and the index being moved into it, and lowers the
+   free slot hint to SLOT. */
+static void
+index_delete (struct dir_index *ix, uint32_t hash, uint32_t slot)
+{
+  table_delete (ix->inode, ix->h.bucket_cnt, hash, slot);
+  if (ix->old != NULL)
+    table_delete (ix->old, ix->h.old_cnt, hash, slot);
+  if (slot < ix->h.free_hint)
+    ix->h.free_hint = slot;
+}
+
+/* Creates an index file of BUCKET_CNT empty buckets, near DIR, and
+   returns it open, storing its sector into *SECTORP.  Returns a
+   null pointer if out of disk space. */
+static struct inode *
+index_create (struct dir *dir, uint32_t bucket_cnt, block_sector_t *sectorp)
+{
+  struct dir_bucket empty = { 0, BUCKET_EMPTY };
+  struct inode *inode;
+
+  if (!free_map_allocate_near (1, inode_get_inumber (dir->inode), sectorp))
+    return NULL;
+  if (!inode_create (*sectorp, 0, false)
+      || (inode = index_open_inode (*sectorp)) == NULL)
+    {
+      free_map_release (*sectorp, 1);
+      return NULL;
+    }
+
+  /* Writing the last bucket sets the file's length; the buckets
+     before it read as empty holes. */
+  if (!index_write_bucket (inode, bucket_cnt - 1, &empty))
+    {
+      inode_remove (inode);
+      inode_close (inode);
+      return NULL;
+    }
+  return inode;
+}
+
+/* Builds a first name index for DIR, sized for it to double, and
+   replaces DIR's old index, if any, with it.  Scans the whole
+   directory, which is only DIR_INDEX_MIN slots long when it first
+   gets an index, and at most DIR_INDEX_BUILD_MAX.  Returns false
+   if out of disk space. */
+static bool
+index_build (struct dir *dir)
+{
+  struct dir_index ix;
+  struct dir_scan scan;
+  const struct dir_entry *e;
+  block_sector_t sector, old;
+  uint32_t slot_cnt = inode_length (dir->inode) / sizeof *e;
+  bool success = true;
+
+  /* Start at a load factor of at most 1/4, so the directory can
+     double before the load factor reaches 1/2. */
+  ix.h.magic = DIR_INDEX_MAGIC;
+  ix.h.bucket_cnt = 64;
+  while (ix.h.bucket_cnt < slot_cnt * 4)
+    ix.h.bucket_cnt *= 2;
+  ix.h.used_cnt = 0;
+  ix.h.free_hint = slot_cnt;
+  ix.h.old_cnt = 0;
+  ix.h.moved = 0;
+  ix.old = NULL;
+
+  ix.inode = index_create (dir, ix.h.bucket_cnt, &sector);
+  if (ix.inode == NULL)
+    return false;
+  dir_scan_begin (&scan, dir->inode, 0);
+  while (success && (e = dir_scan_next (&scan)) != NULL)
+    {
+      uint32_t slot = scan.ofs / sizeof *e - 1;
+      if (e->in_use)
+        success = index_insert (&ix, hash_string (e->name), slot);
+      else if (slot < ix.h.free_hint)
+        ix.h.free_hint = slot;
+    }
+  dir_scan_end (&scan);
+
+  if (!success)
+    {
+      inode_remove (ix.inode);
+      index_close (&ix, false);
+      return false;
+    }
+  index_close (&ix, true);
+
+  old = inode_get_aux (dir->inode);
+  inode_set_aux (dir->inode, sector);
+  if (old != (block_sector_t) -1)
+    {
+      ix.inode = inode_open (old);
+      inode_remove (ix.inode);
+      inode_close (ix.inode);
+    }
+  return true;
+}
+
+/* Replaces DIR's index IX by an empty one twice its size, which
+   keeps the old one as its companion until index_move() has moved
+   all of its buckets over.  Returns false, leaving IX as it was,
+   if out of disk space. */
+static bool
+index_grow (struct dir *dir, struct dir_index *ix)
+{
+  block_sector_t sector;
+  struct inode *inode;
+
+  inode = index_create (dir, ix->h.bucket_cnt * 2, &sector);
+  if (inode == NULL)
+    return false;
+  inode_set_aux (inode, inode_get_inumber (ix->inode));
+  inode_set_aux (dir->inode, sector);
+
+  ix->old = ix->inode;
+  ix->inode = inode;
+  ix->h.old_cnt = ix->h.bucket_cnt;
+  ix->h.moved = 0;
+  ix->h.bucket_cnt *= 2;
+  ix->h.used_cnt = 0;
+  return true;
+}
+
+/* Moves the next INDEX_MOVE_BUCKETS buckets of the index being
+   moved into IX over, and drops the old index once all of them
+   are.  Buckets stay behind in the old index, which lookups only
+   consult for names not found in IX. */
+static void
+index_move (struct dir_index *ix)
+{
+  uint32_t end = ix->h.moved + INDEX_MOVE_BUCKETS;
+
+  if (end > ix->h.old_cnt)
+    end = ix->h.old_cnt;
+  for (; ix->h.moved < end; ix->h.moved++)
+    {
+      struct dir_bucket bucket;
+
+      index_read_bucket (ix->old, ix->h.moved, &bucket);
+      if (bucket.slot != BUCKET_EMPTY && bucket.slot != BUCKET_DELETED
+          && !index_insert (ix, bucket.hash, bucket.slot - 1))
+        return;
+    }
+  if (ix->h.moved == ix->h.old_cnt)
+    {
+      inode_set_aux (ix->inode, -1);
+      inode_remove (ix->old);
+      inode_close (ix->old);
+      ix->old = NULL;
+      ix->h.old_cnt = 0;
+      ix->h.moved = 0;
+    }
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -99,23 +557,34 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_index ix;
+  struct dir_scan scan;
+  const struct dir_entry *e;
+  bool found = false;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
+  if (index_open (dir, &ix))
+    {
+      found = index_lookup (dir, &ix, name, hash_string (name), ep, ofsp);
+      index_close (&ix, false);
+      return found;
+    }
+
+  dir_scan_begin (&scan, dir->inode, 0);
+  while ((e = dir_scan_next (&scan)) != NULL)
+    if (e->in_use && !strcmp (name, e->name)) 
       {
         if (ep != NULL)
-          *ep = e;
+          *ep = *e;
         if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
+          *ofsp = scan.ofs - sizeof *e;
+        found = true;
+        break;
       }
-  return false;
+  dir_scan_end (&scan);
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -126,15 +595,23 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
+  block_sector_t parent, sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  /* Changes to DIR hold its lock exclusively and keep the dentry
+     cache in step, so a miss can be filled in safely. */
+  rwlock_acquire_read (inode_dir_lock (dir->inode));
+  parent = inode_get_inumber (dir->inode);
+  if (!dcache_lookup (parent, name, &sector))
+    {
+      sector = lookup (dir, name, &e, NULL) ? e.inode_sector : (block_sector_t) -1;
+      dcache_insert (parent, name, sector);
+    }
+  *inode = sector != (block_sector_t) -1 ? inode_open (sector) : NULL;
+  rwlock_release_read (inode_dir_lock (dir->inode));
 
   return *inode != NULL;
 }
@@ -149,7 +626,11 @@ bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
   struct dir_entry e;
-  off_t ofs;
+  struct dir_index ix;
+  struct dir_scan scan;
+  const struct dir_entry *slot;
+  bool indexed;
+  off_t ofs, slot_cnt;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -159,21 +640,48 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  journal_begin (JOURNAL_DIR_BLOCKS);
+  rwlock_acquire_write (inode_dir_lock (dir->inode));
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
+  /* Index the directory once it is big enough, and grow the index
+     before its load factor reaches 1/2, moving a few buckets of the
+     outgrown one over each time. */
+  indexed = index_open (dir, &ix);
+  slot_cnt = inode_length (dir->inode) / (off_t) sizeof e;
+  if (!indexed && slot_cnt >= DIR_INDEX_MIN
+      && slot_cnt <= DIR_INDEX_BUILD_MAX && index_build (dir))
+    indexed = index_open (dir, &ix);
+  if (indexed)
+    {
+      if (ix.old == NULL && (ix.h.used_cnt + 1) * 2 > ix.h.bucket_cnt)
+        index_grow (dir, &ix);
+      if (ix.old != NULL)
+        index_move (&ix);
+
+      /* Probes need an empty bucket to stop at. */
+      if (ix.h.used_cnt + 1 >= ix.h.bucket_cnt)
+        {
+          index_close (&ix, true);
+          goto done;
+        }
+    }
+
+  /* Set OFS to offset of free slot, looking from the index's
+     hint on.  If there are no free slots, then it will be set to
+     the current end-of-file.
      
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+  dir_scan_begin (&scan, dir->inode, indexed ? ix.h.free_hint * sizeof e : 0);
+  while ((slot = dir_scan_next (&scan)) != NULL && slot->in_use)
+    continue;
+  ofs = slot != NULL ? scan.ofs - (off_t) sizeof e : scan.ofs;
+  dir_scan_end (&scan);
 
   /* Write slot. */
   e.in_use = true;
@@ -181,7 +689,26 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
+  if (indexed)
+    {
+      if (success)
+        {
+          ix.h.free_hint = ofs / sizeof e + 1;
+          index_insert (&ix, hash_string (name), ofs / sizeof e);
+        }
+      index_close (&ix, true);
+    }
+  if (success)
+    {
+      dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+      /* Anything but "." and ".." names a newly created inode. */
+      if (strcmp (name, ".") && strcmp (name, ".."))
+        dcache_purge_parent (inode_sector);
+    }
+
  done:
+  rwlock_release_write (inode_dir_lock (dir->inode));
+  journal_end ();
   return success;
 }
 
@@ -192,6 +719,7 @@ bool
 dir_remove (struct dir *dir, const char *name) 
 {
   struct dir_entry e;
+  struct dir_index ix;
   struct inode *inode = NULL;
   bool success = false;
   off_t ofs;
@@ -199,6 +727,9 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  journal_begin (JOURNAL_DIR_BLOCKS);
+  rwlock_acquire_write (inode_dir_lock (dir->inode));
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -212,13 +743,23 @@ dir_remove (struct dir *dir, const char *name)
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  if (index_open (dir, &ix))
+    {
+      index_delete (&ix, hash_string (name), ofs / sizeof e);
+      index_close (&ix, true);
+    }
+  dcache_insert (inode_get_inumber (dir->inode), name, -1);
+  if (inode_isdir (inode))
+    dcache_purge_parent (e.inode_sector);
 
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  rwlock_release_write (inode_dir_lock (dir->inode));
   inode_close (inode);
+  journal_end ();
   return success;
 }
 
@@ -228,18 +769,59 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
+  block_sector_t inumber;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  return dir_readdir_entry (dir, name, &inumber, NULL);
+}
+
+/* Like dir_readdir(), but also stores the sector of the entry's
+   inode into *INUMBER and, if ISDIR is nonnull, whether it is a
+   directory into *ISDIR.  The type is read while DIR is locked,
+   so the entry cannot be removed meanwhile; an entry whose inode
+   cannot be opened is skipped. */
+bool
+dir_readdir_entry (struct dir *dir, char name[NAME_MAX + 1],
+                   block_sector_t *inumber, bool *isdir)
+{
+  struct dir_scan scan;
+  const struct dir_entry *e;
+  struct inode *inode = NULL;
+  bool found = false;
+
+  rwlock_acquire_read (inode_dir_lock (dir->inode));
+  while (!found)
     {
-      dir->pos += sizeof e;
-      if (e.in_use)
+      block_sector_t sector = (block_sector_t) -1;
+
+      dir_scan_begin (&scan, dir->inode, dir->pos);
+      while ((e = dir_scan_next (&scan)) != NULL) 
+        if (e->in_use)
+          {
+            strlcpy (name, e->name, NAME_MAX + 1);
+            sector = e->inode_sector;
+            break;
+          }
+      dir->pos = scan.ofs;
+      dir_scan_end (&scan);
+      if (sector == (block_sector_t) -1)
+        break;
+
+      if (isdir != NULL)
         {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        } 
+          inode = inode_open (sector);
+          if (inode == NULL)
+            continue;
+          *isdir = inode_isdir (inode);
+        }
+      *inumber = sector;
+      found = true;
     }
-  return false;
+  rwlock_release_read (inode_dir_lock (dir->inode));
+
+  /* Closing may delete a removed file, which is a journal
+     operation, so not while DIR is locked. */
+  inode_close (inode);
+  return found;
 }
 
 /* is directory empty or not */
@@ -4,6 +4,11 @@
 #include "threads/malloc.h"
 #include "threads/thread.h"
 #include "filesys/file.h"
+#include "devices/block.h"
+
+/* Read-ahead window bounds, in bytes. */
+#define READ_AHEAD_MIN (2 * BLOCK_SECTOR_SIZE)
+#define READ_AHEAD_MAX (16 * BLOCK_SECTOR_SIZE)
 
 /* An open file. */
 struct file
@@ -11,6 +16,10 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    off_t ra_pos;               /* Offset a sequential read would start at. */
+    off_t ra_window;            /* Read-ahead window, 0 if not sequential. */
+    off_t ra_end;               /* End of data already queued for read-ahead. */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -25,6 +34,11 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      /* No read starts at -1, so the first read never counts as
+         sequential and the window opens on the second. */
+      file->ra_pos = -1;
+      file->ra_window = 0;
+      file->ra_end = 0;
       return file;
     }
   else
@@ -62,6 +76,42 @@ file_get_inode (struct file *file)
   return file->inode;
 }
 
+/* Updates FILE's read-ahead state after BYTES_READ bytes were
+   read at offset OFS.  A read that starts where the previous one
+   ended opens or doubles the read-ahead window, anything else
+   closes it.  Data in the window not yet requested is queued for
+   the buffer cache to fetch in the background. */
+static void
+file_read_ahead (struct file *file, off_t ofs, off_t bytes_read)
+{
+  off_t start, end;
+
+  if (ofs == file->ra_pos)
+    {
+      if (file->ra_window == 0)
+        file->ra_window = READ_AHEAD_MIN;
+      else if (file->ra_window < READ_AHEAD_MAX)
+        file->ra_window *= 2;
+    }
+  else
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  file->ra_pos = ofs + bytes_read;
+
+  if (file->ra_window == 0)
+    return;
+
+  start = file->ra_end > file->ra_pos ? file->ra_end : file->ra_pos;
+  end = file->ra_pos + file->ra_window;
+  if (start < end)
+    {
+      inode_read_ahead (file->inode, start, end - start);
+      file->ra_end = end;
+    }
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
    starting at the file's current position.
    Returns the number of bytes actually read,
@@ -71,6 +121,8 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  if (bytes_read > 0)
+    file_read_ahead (file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -7,6 +7,7 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
 
 #include "threads/thread.h"
 #include "threads/malloc.h"
@@ -27,11 +28,16 @@ filesys_init (bool format)
 
   inode_init ();
   free_map_init ();
+  journal_init ();
   cache_init ();
+  dir_init ();
     
   if (format) 
     do_format ();
+  else
+    inode_load_layout ();
 
+  journal_open ();
   free_map_open ();
   /* initial main thread pwd as root dir */
   thread_current()->pwd = inode_open(ROOT_DIR_SECTOR);
@@ -42,8 +48,9 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
-  cache_flush();
+  journal_close ();
   free_map_close ();
+  cache_flush();
 }
 
 static char*
@@ -145,11 +152,15 @@ filesys_create (const char *name, off_t initial_size)
   bool success = false;
   
   dir = parse_filepath(name, &filename, true);
-  if (dir != NULL) success = ( free_map_allocate (1, &inode_sector, true)
+  journal_begin (JOURNAL_DIR_BLOCKS);
+  /* keep the inode near its directory */
+  if (dir != NULL) success = ( free_map_allocate_near (1, inode_get_inumber (dir_get_inode (dir)),
+                                                       &inode_sector)
                   && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, filename, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
+  journal_end ();
     
   dir_close (dir);
   if (filename != NULL) free(filename);
@@ -157,6 +168,49 @@ filesys_create (const char *name, off_t initial_size)
     
 }
 
+/* Creates a directory named NAME, with "." and ".." entries.
+   The directory and its entries are one journal transaction, so
+   a crash leaves either all of them or none.
+   Returns true if successful, false otherwise.
+   Fails if NAME is empty or "/", if a file named NAME already
+   exists, or if internal memory allocation fails. */
+bool
+filesys_mkdir (const char *name)
+{
+  struct file *dir_file;
+  struct inode *dir_inode;
+  struct dir *dir, *parent;
+  char *dirname = NULL;
+  bool success = false;
+
+  if (!strcmp (name, "") || !strcmp (name, "/"))
+    return false;
+
+  journal_begin (2 * JOURNAL_DIR_BLOCKS);
+  if (!filesys_create (name, 0))
+    goto done;
+
+  dir_file = filesys_open (name);
+  ASSERT (dir_file != NULL);
+  dir_inode = file_get_inode (dir_file);
+  inode_setdir (dir_inode, true);
+  dir = dir_open (inode_reopen (dir_inode));
+
+  parent = parse_filepath (name, &dirname, false);
+  ASSERT (parent != NULL && dirname != NULL);
+  success = (dir_add (dir, ".", inode_get_inumber (dir_inode))
+             && dir_add (dir, "..", inode_get_inumber (dir_get_inode (parent))));
+
+  dir_close (parent);
+  free (dirname);
+  dir_close (dir);
+  file_close (dir_file);
+
+ done:
+  journal_end ();
+  return success;
+}
+
 /* Opens the file with the given NAME.
    Returns the new file if successful or a null pointer
    otherwise.
@@ -208,6 +262,7 @@ do_format (void)
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_create ();
   free_map_close ();
   printf ("done.\n");
 }
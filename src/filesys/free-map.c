@@ -1,12 +1,47 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Bits of the free map stored in one sector of its file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* The disk is split into allocation groups of this many sectors,
+   each described by one sector of the free map file. */
+#define GROUP_SECTORS BITS_PER_SECTOR
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_map;     /* Free map file sectors changed
+                                        since last written. */
+static size_t group_cnt;             /* Number of allocation groups. */
+static size_t *group_free;           /* Free sectors in each group. */
+static block_sector_t cursor;        /* Next-fit start without a goal. */
+static struct lock free_map_lock;    /* Guards the members above. */
+
+/* Recomputes the free sector count of every group from the
+   free map. */
+static void
+count_groups (void)
+{
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
+    {
+      size_t start = g * GROUP_SECTORS;
+      size_t cnt = bitmap_size (free_map) - start;
+      if (cnt > GROUP_SECTORS)
+        cnt = GROUP_SECTORS;
+      group_free[g] = bitmap_count (free_map, start, cnt, false);
+    }
+}
 
 /* Initializes the free map. */
 void
@@ -15,38 +50,199 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (block_size (fs_device), GROUP_SECTORS);
+  dirty_map = bitmap_create (group_cnt);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (dirty_map == NULL || group_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  count_groups ();
+  cursor = 0;
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+/* Records that CNT sectors starting at SECTOR were allocated
+   (if ALLOCATED) or freed: adjusts the free counts of their groups
+   and marks their free map file sectors for free_map_flush(). */
+static void
+account (block_sector_t sector, size_t cnt, bool allocated)
+{
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+
+  while (cnt > 0)
+    {
+      size_t g = sector / GROUP_SECTORS;
+      size_t n = (g + 1) * GROUP_SECTORS - sector;
+      if (n > cnt)
+        n = cnt;
+      if (allocated)
+        group_free[g] -= n;
+      else
+        group_free[g] += n;
+      bitmap_mark (dirty_map, g);
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Returns the first of CNT free sectors found at or after START,
+   wrapping around to the start of the disk, or BITMAP_ERROR.
+   Groups without CNT free sectors are skipped unscanned at first;
+   a run crossing into the next group may still fit, so the whole
+   map is scanned before giving up. */
+static block_sector_t
+scan_groups (block_sector_t start, size_t cnt)
+{
+  size_t first = start / GROUP_SECTORS;
+  size_t g;
+
+  /* A run longer than a group can't be ruled out by the counts. */
+  if (cnt > GROUP_SECTORS)
+    return bitmap_scan (free_map, 0, cnt, false);
+
+  for (g = first; g < group_cnt; g++)
+    if (group_free[g] >= cnt)
+      {
+        size_t from = g == first ? start : g * GROUP_SECTORS;
+        block_sector_t sector = bitmap_scan (free_map, from, cnt, false);
+        if (sector != BITMAP_ERROR)
+          return sector;
+
+        /* Nothing free from FROM to the end of the disk. */
+        break;
+      }
+  for (g = 0; g <= first && g < group_cnt; g++)
+    if (group_free[g] >= cnt)
+      {
+        block_sector_t sector = bitmap_scan (free_map, g * GROUP_SECTORS,
+                                             cnt, false);
+        if (sector != BITMAP_ERROR)
+          return sector;
+        break;
+      }
+
+  /* Fragmented: the run, if any, spans groups that each have
+     fewer than CNT free sectors. */
+  if (cnt > 1)
+    {
+      block_sector_t sector = bitmap_scan (free_map, start, cnt, false);
+      if (sector == BITMAP_ERROR)
+        sector = bitmap_scan (free_map, 0, cnt, false);
+      return sector;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Allocates CNT consecutive sectors from the free map, as close
+   after GOAL as possible, and stores the first into *SECTORP.
+   Without a goal (GOAL == BITMAP_ERROR), allocation continues
+   from where the last one without a goal ended.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.  The change reaches the free map file
+   at the next free_map_flush(). */
 bool
-free_map_allocate (size_t cnt, block_sector_t *sectorp, bool write_freemap)
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR && write_freemap
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+
+  lock_acquire (&free_map_lock);
+  if (goal >= bitmap_size (free_map))
+    goal = BITMAP_ERROR;
+  sector = scan_groups (goal != BITMAP_ERROR ? goal : cursor, cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      account (sector, cnt, true);
+      if (goal == BITMAP_ERROR)
+        cursor = (sector + cnt) % bitmap_size (free_map);
     }
+  lock_release (&free_map_lock);
+
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates CNT consecutive sectors from the free map and stores
+   the first into *SECTORP.
+   Returns true if successful, false if not enough consecutive
+   sectors were available. */
+bool
+free_map_allocate (size_t cnt, block_sector_t *sectorp)
+{
+  return free_map_allocate_near (cnt, BITMAP_ERROR, sectorp);
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  Their
+   cached blocks are dropped, so a pending metadata change cannot
+   reach the log once a sector is reused for file data. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  account (sector, cnt, false);
+  lock_release (&free_map_lock);
+  cache_forget (sector, cnt);
+  journal_revoke (sector, cnt);
+}
+
+/* Returns true if SECTOR is allocated. */
+bool
+free_map_in_use (block_sector_t sector)
+{
+  bool in_use;
+
+  lock_acquire (&free_map_lock);
+  in_use = bitmap_test (free_map, sector);
+  lock_release (&free_map_lock);
+  return in_use;
+}
+
+/* Returns the number of sectors of the free map file, the most
+   free_map_flush() may write. */
+size_t
+free_map_sectors (void)
+{
+  return group_cnt;
+}
+
+/* Writes the sectors of the free map file whose bits changed
+   into the buffer cache, which takes them to disk on its next
+   flush.  Called periodically by the cache's flush thread.
+
+   The lock is not held while writing: the free map file may
+   itself need a sector allocated.  A bit that flips during the
+   write marks its sector dirty again, so it is written next time. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  if (free_map_file == NULL)
+    return;
+
+  for (i = 0; i < bitmap_size (dirty_map); i++)
+    {
+      bool dirty;
+
+      lock_acquire (&free_map_lock);
+      dirty = bitmap_test (dirty_map, i);
+      bitmap_reset (dirty_map, i);
+      lock_release (&free_map_lock);
+
+      if (dirty && !bitmap_write_part (free_map, free_map_file,
+                                       i * BLOCK_SECTOR_SIZE,
+                                       BLOCK_SECTOR_SIZE))
+        {
+          lock_acquire (&free_map_lock);
+          bitmap_mark (dirty_map, i);
+          lock_release (&free_map_lock);
+        }
+    }
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -56,15 +252,24 @@ free_map_open (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  inode_set_metadata (file_get_inode (free_map_file));
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  lock_acquire (&free_map_lock);
+  bitmap_set_all (dirty_map, false);
+  count_groups ();
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file = free_map_file;
+
+  free_map_flush ();
+  free_map_file = NULL;
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -80,6 +285,7 @@ free_map_create (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  inode_set_metadata (file_get_inode (free_map_file));
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
 }
@@ -1,5 +1,6 @@
 #include "filesys/inode.h"
 #include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
@@ -8,12 +9,15 @@
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
 
-/* Identifies an inode. */
+/* Identifies an inode.  The magic number also tells how the
+   inode maps its data: through index blocks or through extents. */
 #define INODE_MAGIC 0x494e4f44
+#define INODE_EXTENT_MAGIC 0x494e4f45
 
 #define UINT8_MAX 255
 #define INODE_META_SIZE 8
@@ -25,6 +29,38 @@
 #define NUM_ENTRY_INDIRECT_SINGLE (BLOCK_SECTOR_SIZE/ENTRY_SIZE)
 #define NUM_ENTRY_INDIRECT_DOUBLE (NUM_ENTRY_INDIRECT_SINGLE * NUM_ENTRY_INDIRECT_SINGLE)
 
+/* A run of LENGTH sectors starting at START that holds the file's
+   blocks from block LOGICAL on.  Above the bottom level of a tree,
+   START is instead a node holding the extents from LOGICAL on, and
+   LENGTH is unused. */
+struct extent
+  {
+    uint32_t logical;                   /* First file block. */
+    block_sector_t start;               /* First sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+#define INODE_EXTENTS 17
+#define NODE_EXTENTS 42
+
+/* Levels of nodes an extent tree may have below its inode.  Nodes
+   are split in halves, so at the deepest a file still has room
+   for 17 * 21^4 extents. */
+#define EXTENT_MAX_DEPTH 4
+
+/* Runs remembered by an open inode's translation cache. */
+#define INODE_MAP_RUNS 8
+
+/* Node of an extent tree: a leaf of data extents, or above the
+   leaves, extents pointing to the nodes a level down.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_node
+  {
+    uint32_t cnt;                       /* Extents in use. */
+    struct extent extents[NODE_EXTENTS];/* Sorted by logical block. */
+    uint32_t unused;
+  };
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
@@ -32,14 +68,32 @@ struct inode_disk
 //    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t direct_blocks[NUM_DIRECT];
-    uint32_t indirect_single_blocks[NUM_INDIRECT];
-    uint32_t indirect_double_blocks[NUM_DOUBLE_INDIRECT];
+    union
+      {
+        struct                          /* INODE_MAGIC. */
+          {
+            uint32_t direct_blocks[NUM_DIRECT];
+            uint32_t indirect_single_blocks[NUM_INDIRECT];
+            uint32_t indirect_double_blocks[NUM_DOUBLE_INDIRECT];
+          };
+        struct                          /* INODE_EXTENT_MAGIC. */
+          {
+            uint16_t extent_cnt;        /* Extents in use. */
+            uint16_t extent_depth;      /* 0: extents map data,
+                                           N: extents point to nodes
+                                           N levels above the data. */
+            struct extent extents[INODE_EXTENTS]; /* Sorted by logical block. */
+          };
+      };
     bool isdir;
     uint8_t unused1[3];
-    uint32_t unused[73];               /* Not used. */
+    block_sector_t aux_sector;          /* Companion inode, or -1. */
+    uint32_t unused[72];               /* Not used. */
   };
 
+/* Whether inode_create() makes extent-mapped inodes. */
+static bool use_extents;
+
 static char size_maxes[BLOCK_SECTOR_SIZE];
 static char zeros[BLOCK_SECTOR_SIZE];
 
@@ -54,35 +108,59 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem hash_elem;         /* Element in open_inodes. */
+    struct list_elem lru_elem;          /* Element in closed_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    bool extents;                       /* Data mapped by extents? */
+    bool metadata;                      /* Data journaled as metadata? */
     struct lock inode_lock;
+    struct rwlock dir_lock;             /* Directory: held shared by
+                                           lookups, exclusively by
+                                           changes. */
+
+    /* Copy of the on-disk metadata, updated under inode_lock.
+       A longer length is written back by inode_flush_meta(). */
+    off_t length;                       /* File size in bytes. */
+    bool isdir;                         /* Is a directory? */
+    bool meta_dirty;                    /* Length not yet on disk? */
+    bool sync_meta;                     /* Length or block map changed
+                                           since inode_sync()? */
+    block_sector_t aux_sector;          /* Companion inode, or -1. */
+
+    /* Translation cache: runs of file blocks whose sectors are
+       known, so lookups skip the index blocks or extent tree. */
+    struct seqlock map_seq;             /* Guards the members below. */
+    struct extent map[INODE_MAP_RUNS];  /* Known runs. */
+    size_t map_cnt;                     /* Number of runs in use. */
+    size_t map_next;                    /* Next run to replace. */
   };
 
 static void
 inode_read_index(block_sector_t block, size_t offset, block_sector_t *sector,
-                 bool allocate, bool index_block, bool write_freemap)
+                 bool allocate, bool index_block, block_sector_t goal)
 {
-    void *cache = cache_allocate_sector(block, CACHE_READ);
-    cache_read(cache, sector, offset, ENTRY_SIZE);
+    const void *index = cache_pin_read(block);
+    *sector = *(const uint32_t *)(index + offset);
+    cache_unpin(index, false);
 
     if (*sector == BITMAP_ERROR && allocate) {
         
-        free_map_allocate (1, sector, write_freemap);
+        free_map_allocate_near (1, goal, sector);
         
         if (*sector == BITMAP_ERROR) return;
         
-        cache = cache_allocate_sector(block, CACHE_WRITE);
+        void *cache = cache_allocate_sector(block, CACHE_WRITE);
         block_sector_t sector_read = cache_index_write(cache, sector, offset);
 
         if (sector_read == *sector) {
-            void *inode_cache = cache_allocate_sector(*sector, CACHE_WRITE);
-            if (index_block)
+            void *inode_cache = cache_allocate_sector(*sector, CACHE_WRITE_ALLOCATE);
+            if (index_block) {
+                cache_log(inode_cache);
                 cache_write(inode_cache, &size_maxes, 0, BLOCK_SECTOR_SIZE);
-            else
+            } else
                 cache_write(inode_cache, &zeros, 0, BLOCK_SECTOR_SIZE);
         } else {
             free_map_release(*sector, 1);
@@ -92,14 +170,403 @@ inode_read_index(block_sector_t block, size_t offset, block_sector_t *sector,
 
 }
 
+/* Returns the last of the CNT extents in EXT, sorted by logical
+   block, that starts at or before LBLOCK, or a null pointer. */
+static const struct extent *
+extent_find (const struct extent *ext, size_t cnt, uint32_t lblock)
+{
+  size_t lo = 0, hi = cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (ext[mid].logical <= lblock)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo > 0 ? &ext[lo - 1] : NULL;
+}
+
+/* Returns the sector in the data extent E holding LBLOCK, or -1
+   if E is null or ends before LBLOCK.  Stores into *RUN the number
+   of sectors mapped contiguously from there on, 1 for a hole. */
+static block_sector_t
+extent_sector (const struct extent *e, uint32_t lblock, size_t *run)
+{
+  *run = 1;
+  if (e == NULL || lblock - e->logical >= e->length)
+    return -1;
+  *run = e->length - (lblock - e->logical);
+  return e->start + (lblock - e->logical);
+}
+
+/* Maps LBLOCK of the extent-mapped inode DISK_INODE to its sector,
+   or -1 for a hole, reading down through the nodes of the tree. */
+static block_sector_t
+extent_map (const struct inode_disk *disk_inode, uint32_t lblock, size_t *run)
+{
+  const struct extent *e = extent_find (disk_inode->extents,
+                                        disk_inode->extent_cnt, lblock);
+  struct extent found;
+  unsigned level;
+
+  for (level = disk_inode->extent_depth; level > 0 && e != NULL; level--)
+    {
+      const struct extent_node *node = cache_pin_read (e->start);
+      e = extent_find (node->extents, node->cnt, lblock);
+      if (e != NULL)
+        {
+          found = *e;
+          e = &found;
+        }
+      cache_unpin (node, false);
+    }
+  return extent_sector (e, lblock, run);
+}
+
+/* Adds a one-sector extent mapping LBLOCK to SECTOR to the CNT
+   extents in EXT, extending the extent that ends right before it
+   if SECTOR follows its run.  Returns false, changing nothing, if
+   that needs a new extent and EXT already holds MAX. */
+static bool
+extent_put (struct extent *ext, uint32_t *cnt, size_t max,
+            uint32_t lblock, block_sector_t sector)
+{
+  struct extent *prev = (struct extent *) extent_find (ext, *cnt, lblock);
+  size_t pos = prev != NULL ? prev - ext + 1 : 0;
+
+  if (prev != NULL && prev->logical + prev->length == lblock
+      && prev->start + prev->length == sector)
+    {
+      prev->length++;
+      return true;
+    }
+  if (*cnt == max)
+    return false;
+
+  memmove (ext + pos + 1, ext + pos, (*cnt - pos) * sizeof *ext);
+  ext[pos].logical = lblock;
+  ext[pos].start = sector;
+  ext[pos].length = 1;
+  (*cnt)++;
+  return true;
+}
+
+/* Allocates a sector near GOAL for a new extent tree node, pinned
+   for writing and empty, and stores its number into *SECTORP.
+   Returns a null pointer if the disk is full. */
+static struct extent_node *
+extent_new_node (block_sector_t goal, block_sector_t *sectorp)
+{
+  struct extent_node *node;
+
+  if (!free_map_allocate_near (1, goal, sectorp))
+    return NULL;
+  node = cache_allocate_sector (*sectorp, CACHE_WRITE_ALLOCATE);
+  memset (node, 0, BLOCK_SECTOR_SIZE);
+  cache_log (node);
+  return node;
+}
+
+/* Outcome of adding an extent to a part of an extent tree. */
+enum extent_result
+  {
+    EXTENT_ADDED,                       /* Added. */
+    EXTENT_FULL,                        /* No room in the part. */
+    EXTENT_NO_SPACE                     /* Disk full. */
+  };
+
+/* Splits NODE, which extent E of the CNT extents in EXT points to,
+   giving its upper half to a new node allocated near GOAL that E's
+   successor then points to.  Returns false if the disk is full. */
+static bool
+extent_split (struct extent *ext, uint32_t *cnt, struct extent *e,
+              struct extent_node *node, block_sector_t goal)
+{
+  struct extent_node *right;
+  block_sector_t right_sector;
+  size_t pos = e - ext + 1;
+
+  right = extent_new_node (goal, &right_sector);
+  if (right == NULL)
+    return false;
+  right->cnt = node->cnt / 2;
+  node->cnt -= right->cnt;
+  memcpy (right->extents, node->extents + node->cnt,
+          right->cnt * sizeof *right->extents);
+
+  memmove (e + 2, e + 1, (*cnt - pos) * sizeof *e);
+  e[1].logical = right->extents[0].logical;
+  e[1].start = right_sector;
+  e[1].length = 0;
+  (*cnt)++;
+  cache_unpin (right, true);
+  return true;
+}
+
+/* Records that LBLOCK lives in SECTOR in the part of an extent tree
+   made of the CNT extents in EXT, which hold at most MAX and are
+   LEVEL levels above the data, and sets *CHANGED if EXT changed.
+   A full node below is split in two; if EXT has no room for the
+   new half, EXTENT_FULL tells the caller to make room and try
+   again.  Nodes below that changed are logged. */
+static enum extent_result
+extent_add (struct extent *ext, uint32_t *cnt, size_t max, unsigned level,
+            uint32_t lblock, block_sector_t sector, bool *changed)
+{
+  if (level == 0)
+    {
+      if (!extent_put (ext, cnt, max, lblock, sector))
+        return EXTENT_FULL;
+      *changed = true;
+      return EXTENT_ADDED;
+    }
+
+  for (;;)
+    {
+      struct extent *e = (struct extent *) extent_find (ext, *cnt, lblock);
+      struct extent_node *node = cache_pin_write (e->start);
+      bool node_changed = false, again = false;
+      enum extent_result result;
+
+      result = extent_add (node->extents, &node->cnt, NODE_EXTENTS,
+                           level - 1, lblock, sector, &node_changed);
+      if (result == EXTENT_FULL && *cnt < max)
+        {
+          /* Split the full node, then look again for the half
+             LBLOCK belongs in. */
+          if (extent_split (ext, cnt, e, node, sector))
+            node_changed = *changed = again = true;
+          else
+            result = EXTENT_NO_SPACE;
+        }
+      if (node_changed)
+        cache_log (node);
+      cache_unpin (node, node_changed);
+      if (!again)
+        return result;
+    }
+}
+
+/* Records in DISK_INODE, which is pinned for writing, that LBLOCK
+   lives in SECTOR, and sets *CHANGED if DISK_INODE itself changed.
+   A full node is split in two, and a full inode moves its extents
+   down into a new node, making the tree a level deeper.  Returns
+   false if the disk or the tree has no room left. */
+static bool
+extent_insert (struct inode_disk *disk_inode, uint32_t lblock,
+               block_sector_t sector, bool *changed)
+{
+  for (;;)
+    {
+      uint32_t cnt = disk_inode->extent_cnt;
+      struct extent_node *node;
+      block_sector_t node_sector;
+      enum extent_result result;
+
+      result = extent_add (disk_inode->extents, &cnt, INODE_EXTENTS,
+                           disk_inode->extent_depth, lblock, sector, changed);
+      disk_inode->extent_cnt = cnt;
+      if (result != EXTENT_FULL)
+        return result == EXTENT_ADDED;
+      if (disk_inode->extent_depth == EXTENT_MAX_DEPTH)
+        return false;
+
+      /* Push the extents down into a new node. */
+      node = extent_new_node (sector, &node_sector);
+      if (node == NULL)
+        return false;
+      node->cnt = cnt;
+      memcpy (node->extents, disk_inode->extents, cnt * sizeof *node->extents);
+      cache_unpin (node, true);
+
+      disk_inode->extent_depth++;
+      disk_inode->extent_cnt = 1;
+      disk_inode->extents[0].logical = 0;
+      disk_inode->extents[0].start = node_sector;
+      disk_inode->extents[0].length = 0;
+      *changed = true;
+    }
+}
+
+/* Returns the sector holding block LBLOCK of extent-mapped INODE,
+   allocating a zeroed one as near GOAL as possible if ALLOCATE, or
+   -1.  *RUN receives the number of sectors mapped contiguously from
+   there on. */
+static block_sector_t
+extent_to_sector (const struct inode *inode, uint32_t lblock, bool allocate,
+                  block_sector_t goal, size_t *run)
+{
+  struct inode_disk *disk_inode;
+  block_sector_t sector;
+  bool changed = false;
+
+  disk_inode = (struct inode_disk *) cache_pin_read (inode->sector);
+  sector = extent_map (disk_inode, lblock, run);
+  cache_unpin (disk_inode, false);
+  if (sector != (block_sector_t) -1 || !allocate)
+    return sector;
+
+  /* The exclusive hold on the inode serializes changes to the tree;
+     look again in case another writer got here first. */
+  disk_inode = cache_pin_write (inode->sector);
+  sector = extent_map (disk_inode, lblock, run);
+  if (sector == (block_sector_t) -1 && free_map_allocate_near (1, goal, &sector))
+    {
+      void *data = cache_allocate_sector (sector, CACHE_WRITE_ALLOCATE);
+      cache_write (data, zeros, 0, BLOCK_SECTOR_SIZE);
+      if (!extent_insert (disk_inode, lblock, sector, &changed))
+        {
+          free_map_release (sector, 1);
+          sector = -1;
+        }
+      *run = 1;
+    }
+
+  /* Only log the inode if the tree changed at its top. */
+  if (changed)
+    cache_log (disk_inode);
+  cache_unpin (disk_inode, changed);
+  return sector;
+}
+
+/* Gives back to the free map the sectors that the CNT extents in
+   EXT, LEVEL levels above the data, map, and the nodes below
+   them. */
+static void
+extent_release_level (const struct extent *ext, size_t cnt, unsigned level)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (level == 0)
+      free_map_release (ext[i].start, ext[i].length);
+    else
+      {
+        const struct extent_node *node = cache_pin_read (ext[i].start);
+        extent_release_level (node->extents, node->cnt, level - 1);
+        cache_unpin (node, false);
+        free_map_release (ext[i].start, 1);
+      }
+}
+
+/* Gives the sectors of extent-mapped DISK_INODE back to the free
+   map, one run at a time. */
+static void
+extent_release (const struct inode_disk *disk_inode)
+{
+  extent_release_level (disk_inode->extents, disk_inode->extent_cnt,
+                        disk_inode->extent_depth);
+}
+
+/* Writes back the nodes that the CNT extents in EXT, LEVEL levels
+   above the data, point to, and the nodes below them. */
+static void
+extent_sync (const struct extent *ext, size_t cnt, unsigned level)
+{
+  size_t i;
+
+  if (level == 0)
+    return;
+  for (i = 0; i < cnt; i++)
+    {
+      const struct extent_node *node = cache_pin_read (ext[i].start);
+      extent_sync (node->extents, node->cnt, level - 1);
+      cache_unpin (node, false);
+      cache_sync (ext[i].start, 1);
+    }
+}
+
+/* Looks up LBLOCK in INODE's translation cache.  Returns its
+   sector and stores into *RUN the number of sectors known to
+   follow it contiguously, or returns -1 if the cache misses.
+   Readers take no lock; they retry if a writer raced them. */
+static block_sector_t
+map_lookup (const struct inode *inode, uint32_t lblock, size_t *run)
+{
+  struct seqlock *seq = (struct seqlock *) &inode->map_seq;
+  block_sector_t sector;
+  unsigned start;
+  size_t i;
+
+  do
+    {
+      start = seqlock_read_begin (seq);
+      sector = -1;
+      for (i = 0; i < inode->map_cnt; i++)
+        {
+          const struct extent *e = &inode->map[i];
+          if (lblock - e->logical < e->length)
+            {
+              sector = e->start + (lblock - e->logical);
+              *run = e->length - (lblock - e->logical);
+              break;
+            }
+        }
+    }
+  while (seqlock_read_retry (seq, start));
+  return sector;
+}
+
+/* Records in INODE's translation cache that RUN sectors starting
+   at SECTOR hold the file from LBLOCK on.  A run that continues a
+   cached one extends it; otherwise the oldest run is replaced.
+   Only mapped blocks are cached, so allocating a block never makes
+   a cached run stale. */
+static void
+map_insert (const struct inode *inode_, uint32_t lblock,
+            block_sector_t sector, size_t run)
+{
+  /* The cache is not part of the inode's contents. */
+  struct inode *inode = (struct inode *) inode_;
+  struct extent *e;
+  size_t i;
+
+  seqlock_write_begin (&inode->map_seq);
+  for (i = 0; i < inode->map_cnt; i++)
+    {
+      e = &inode->map[i];
+      if (lblock - e->logical < e->length)
+        goto done;
+      if (e->logical + e->length == lblock && e->start + e->length == sector)
+        {
+          e->length += run;
+          goto done;
+        }
+    }
+  e = &inode->map[inode->map_next];
+  e->logical = lblock;
+  e->start = sector;
+  e->length = run;
+  inode->map_next = (inode->map_next + 1) % INODE_MAP_RUNS;
+  if (inode->map_cnt < INODE_MAP_RUNS)
+    inode->map_cnt++;
+ done:
+  seqlock_write_end (&inode->map_seq);
+}
+
+/* Forgets every run in INODE's translation cache.  Must be called
+   before any of INODE's blocks are freed. */
+static void
+map_invalidate (struct inode *inode)
+{
+  seqlock_write_begin (&inode->map_seq);
+  inode->map_cnt = 0;
+  inode->map_next = 0;
+  seqlock_write_end (&inode->map_seq);
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
-   Allocate new block if the position has not been assigned a block.
+   within index-mapped INODE.
+   Allocate new block if the position has not been assigned a block,
+   placing new blocks as near GOAL as possible.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 /* dynamic allocate new sector */
 static block_sector_t
-byte_to_sector(const struct inode *inode, off_t pos, bool allocate){
+index_to_sector(const struct inode *inode, off_t pos, bool allocate,
+                block_sector_t goal){
     ASSERT (inode != NULL);
           
     uint32_t index_pos;
@@ -111,7 +578,7 @@ byte_to_sector(const struct inode *inode, off_t pos, bool allocate){
         index_pos = pos / BLOCK_SECTOR_SIZE;
         offset = INODE_META_SIZE+index_pos*ENTRY_SIZE;
         index_sector = inode->sector;
-        inode_read_index(index_sector, offset, &sector, allocate, false, inode->sector != FREE_MAP_SECTOR);
+        inode_read_index(index_sector, offset, &sector, allocate, false, goal);
 
         if (sector == BITMAP_ERROR) return -1;
         return sector;
@@ -122,14 +589,14 @@ byte_to_sector(const struct inode *inode, off_t pos, bool allocate){
         index_pos = pos / (NUM_ENTRY_INDIRECT_SINGLE * BLOCK_SECTOR_SIZE);
         offset = INODE_META_SIZE+(NUM_DIRECT+index_pos)*ENTRY_SIZE;
         index_sector = inode->sector;
-        inode_read_index(index_sector, offset, &sector, allocate, true, inode->sector != FREE_MAP_SECTOR);
+        inode_read_index(index_sector, offset, &sector, allocate, true, goal);
         if (sector == BITMAP_ERROR ) return -1;
 
         index_sector = sector;
         pos -= index_pos * NUM_ENTRY_INDIRECT_SINGLE * BLOCK_SECTOR_SIZE;
         index_pos = pos/BLOCK_SECTOR_SIZE;
         offset = index_pos*ENTRY_SIZE;
-        inode_read_index(index_sector, offset, &sector, allocate, false, inode->sector != FREE_MAP_SECTOR);
+        inode_read_index(index_sector, offset, &sector, allocate, false, goal);
         if (sector == BITMAP_ERROR) return -1;
 
         return sector;
@@ -140,21 +607,21 @@ byte_to_sector(const struct inode *inode, off_t pos, bool allocate){
         index_pos = pos / (NUM_ENTRY_INDIRECT_DOUBLE * BLOCK_SECTOR_SIZE);
         offset = INODE_META_SIZE+(NUM_DIRECT+NUM_INDIRECT+index_pos)*ENTRY_SIZE;
         index_sector = inode->sector;
-        inode_read_index(index_sector, offset, &sector, allocate, true, inode->sector != FREE_MAP_SECTOR);
+        inode_read_index(index_sector, offset, &sector, allocate, true, goal);
         if (sector == BITMAP_ERROR) return -1;
 
         index_sector = sector;
         pos -= index_pos * NUM_ENTRY_INDIRECT_DOUBLE * BLOCK_SECTOR_SIZE;
         index_pos = pos/(NUM_ENTRY_INDIRECT_SINGLE * BLOCK_SECTOR_SIZE);
         offset = index_pos*ENTRY_SIZE;
-        inode_read_index(index_sector, offset, &sector, allocate, true, inode->sector != FREE_MAP_SECTOR);
+        inode_read_index(index_sector, offset, &sector, allocate, true, goal);
         if (sector == BITMAP_ERROR) return -1;
 
         index_sector = sector;
         pos -= index_pos * NUM_ENTRY_INDIRECT_SINGLE * BLOCK_SECTOR_SIZE;
         index_pos = pos/ BLOCK_SECTOR_SIZE;
         offset = index_pos*ENTRY_SIZE;
-        inode_read_index(index_sector, offset, &sector, allocate, false, inode->sector != FREE_MAP_SECTOR);
+        inode_read_index(index_sector, offset, &sector, allocate, false, goal);
         if (sector == BITMAP_ERROR) return -1;
 
         return sector;
@@ -162,17 +629,113 @@ byte_to_sector(const struct inode *inode, off_t pos, bool allocate){
 }
 
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns the block device sector that contains byte offset POS
+   within INODE, allocating a block there first if ALLOCATE, or -1.
+   Also stores into *RUN how many sectors from POS on are known to
+   be mapped contiguously, so callers walking a file look up each
+   run once.  Asks the translation cache before the on-disk map. */
+static block_sector_t
+byte_to_run (const struct inode *inode, off_t pos, bool allocate, size_t *run)
+{
+  uint32_t lblock = pos / BLOCK_SECTOR_SIZE;
+  block_sector_t sector = map_lookup (inode, lblock, run);
+
+  if (sector != (block_sector_t) -1)
+    return sector;
+
+  /* New blocks go right after the previous block of the file, or
+     after the inode. */
+  block_sector_t goal = inode->sector + 1;
+  size_t prev_run;
+  if (allocate && lblock > 0
+      && (sector = map_lookup (inode, lblock - 1, &prev_run)) != (block_sector_t) -1)
+    goal = sector + 1;
 
+  if (inode->extents)
+    sector = extent_to_sector (inode, lblock, allocate, goal, run);
+  else
+    {
+      *run = 1;
+      sector = index_to_sector (inode, pos, allocate, goal);
+    }
+  if (sector != (block_sector_t) -1)
+    map_insert (inode, lblock, sector, *run);
+  return sector;
+}
+
+/* Returns the block device sector that contains byte offset POS
+   within INODE, allocating a block there first if ALLOCATE.
+   Returns -1 if there is no such block. */
+static block_sector_t
+byte_to_sector (const struct inode *inode, off_t pos, bool allocate)
+{
+  size_t run;
+  return byte_to_run (inode, pos, allocate, &run);
+}
+
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  Also holds the inodes
+   on closed_inodes. */
+static struct hash open_inodes;
+
+/* Inodes nobody has open any more, least recently closed first.
+   They stay in open_inodes, with their metadata and translation
+   cache, until INODE_LRU_MAX newer ones push them out. */
+static struct list closed_inodes;
+static size_t closed_cnt;
+#define INODE_LRU_MAX 32
+
+/* Guards open_inodes, closed_inodes and open counts. */
 static struct lock inode_global_lock;
 
+static unsigned
+inode_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, hash_elem)->sector);
+}
+
+static bool
+inode_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                 void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, hash_elem)->sector
+          < hash_entry (b, struct inode, hash_elem)->sector);
+}
+
+/* Returns the inode in open_inodes for SECTOR, or a null pointer. */
+static struct inode *
+inode_lookup (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *h;
+
+  ASSERT (lock_held_by_current_thread (&inode_global_lock));
+
+  key.sector = sector;
+  h = hash_find (&open_inodes, &key.hash_elem);
+  return h != NULL ? hash_entry (h, struct inode, hash_elem) : NULL;
+}
+
+/* Takes another reference to INODE, which may be a closed inode
+   on its way out of the LRU. */
+static void
+inode_get (struct inode *inode)
+{
+  ASSERT (lock_held_by_current_thread (&inode_global_lock));
+
+  if (inode->open_cnt++ == 0)
+    {
+      list_remove (&inode->lru_elem);
+      closed_cnt--;
+    }
+}
+
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash_func, inode_less_func, NULL);
+  list_init (&closed_inodes);
   lock_init(&inode_global_lock);
   memset(size_maxes, UINT8_MAX, BLOCK_SECTOR_SIZE);
   memset(zeros, 0, BLOCK_SECTOR_SIZE);
@@ -203,7 +766,17 @@ inode_create (block_sector_t sector, off_t length, bool isdir)
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->isdir = isdir;
-      block_write (fs_device, sector, disk_inode);
+      if (use_extents)
+        {
+          disk_inode->magic = INODE_EXTENT_MAGIC;
+          disk_inode->extent_cnt = 0;
+          disk_inode->extent_depth = 0;
+        }
+      journal_begin (JOURNAL_INODE_BLOCKS);
+      void *cache = cache_allocate_sector (sector, CACHE_WRITE_ALLOCATE);
+      cache_log (cache);
+      cache_write (cache, disk_inode, 0, BLOCK_SECTOR_SIZE);
+      journal_end ();
       free (disk_inode);
       success = true;
     }
@@ -216,23 +789,16 @@ inode_create (block_sector_t sector, off_t length, bool isdir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
-  struct inode *inode;
+  struct inode *inode, *other;
 
-  /* Check whether this inode is already open. */
+  /* Check whether this inode is already open, or recently was. */
   lock_acquire(&inode_global_lock);
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          lock_release(&inode_global_lock);
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  inode = inode_lookup (sector);
+  if (inode != NULL)
+    inode_get (inode);
   lock_release(&inode_global_lock);
+  if (inode != NULL)
+    return inode;
     
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
@@ -240,15 +806,39 @@ inode_open (block_sector_t sector)
     return NULL;
 
   /* Initialize. */
-  lock_acquire(&inode_global_lock);
-  list_push_front (&open_inodes, &inode->elem);
-  lock_release(&inode_global_lock);
-    
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->metadata = false;
   lock_init(&inode->inode_lock);
+  rwlock_init (&inode->dir_lock);
+  seqlock_init (&inode->map_seq);
+  inode->map_cnt = 0;
+  inode->map_next = 0;
+
+  const struct inode_disk *disk_inode = cache_pin_read (sector);
+  inode->extents = disk_inode->magic == INODE_EXTENT_MAGIC;
+  inode->length = disk_inode->length;
+  inode->isdir = disk_inode->isdir;
+  inode->aux_sector = disk_inode->aux_sector;
+  inode->meta_dirty = false;
+  inode->sync_meta = true;
+  cache_unpin (disk_inode, false);
+
+  /* Publish it, unless another thread opened it meanwhile. */
+  lock_acquire(&inode_global_lock);
+  other = inode_lookup (sector);
+  if (other == NULL)
+    hash_insert (&open_inodes, &inode->hash_elem);
+  else
+    inode_get (other);
+  lock_release(&inode_global_lock);
+  if (other != NULL)
+    {
+      free (inode);
+      return other;
+    }
     
   return inode;
 }
@@ -258,9 +848,9 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL) {
-    lock_acquire(&inode->inode_lock);
-    inode->open_cnt++;
-    lock_release(&inode->inode_lock);
+    lock_acquire(&inode_global_lock);
+    inode_get (inode);
+    lock_release(&inode_global_lock);
   }
     
   return inode;
@@ -273,12 +863,44 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
+/* Writes INODE's length back to its on-disk inode if it grew
+   since the last write-back. */
+static void
+inode_flush_meta (struct inode *inode)
+{
+  struct inode_disk *disk_inode;
+
+  if (!inode->meta_dirty)
+    return;
+
+  journal_begin (JOURNAL_INODE_BLOCKS);
+  lock_acquire (&inode->inode_lock);
+  if (inode->meta_dirty)
+    {
+      disk_inode = cache_pin_write (inode->sector);
+      disk_inode->length = inode->length;
+      cache_log (disk_inode);
+      cache_unpin (disk_inode, true);
+      inode->meta_dirty = false;
+    }
+  lock_release (&inode->inode_lock);
+  journal_end ();
+}
+
 /* free sparsely allocated blocks */
 static void
 inode_free_map_release(struct inode *inode)
 {
     void *cache;
     uint32_t *sector;
+    map_invalidate(inode);
+    if (inode->extents) {
+        const struct inode_disk *disk_inode = cache_pin_read(inode->sector);
+        extent_release(disk_inode);
+        cache_unpin(disk_inode, false);
+        return;
+    }
+    
     void *buffer = malloc(BLOCK_SECTOR_SIZE);
     void *buffer2 = malloc(BLOCK_SECTOR_SIZE);
     void *buffer3 = malloc(BLOCK_SECTOR_SIZE);
@@ -351,33 +973,42 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  lock_acquire(&inode->inode_lock);
-  --inode->open_cnt;
-  if (inode->open_cnt == 0)
-    {
-      /* acquire global lock in case another thread try to open inode containing same block sector */
-      lock_acquire(&inode_global_lock);
-      if (inode->open_cnt == 0) {
-         /* Remove from inode list and release lock. */
-         list_remove (&inode->elem);
-         /* Deallocate blocks if removed. */
-         if (inode->removed)
-           {
-             inode_free_map_release(inode);
-             free_map_release (inode->sector, 1);
-           }
-         lock_release(&inode->inode_lock);
-         free (inode);
-      } else {
-          lock_release(&inode->inode_lock);
-      }
-        
+  inode_flush_meta (inode);
+
+  /* Release resources if this was the last opener.  A removed
+     inode goes away for good; any other one is kept on the LRU of
+     closed inodes in case it is opened again soon. */
+  lock_acquire(&inode_global_lock);
+  if (--inode->open_cnt > 0) {
       lock_release(&inode_global_lock);
-        
-    } else {
-        lock_release(&inode->inode_lock);
-    }
+      return;
+  }
+  if (inode->removed) {
+      hash_delete (&open_inodes, &inode->hash_elem);
+      lock_release(&inode_global_lock);
+
+      /* Deallocate blocks, and the companion inode's. */
+      journal_begin (JOURNAL_INODE_BLOCKS);
+      inode_free_map_release(inode);
+      free_map_release (inode->sector, 1);
+      if (inode->aux_sector != (block_sector_t) -1) {
+          struct inode *aux = inode_open (inode->aux_sector);
+          inode_remove (aux);
+          inode_close (aux);
+      }
+      journal_end ();
+      free (inode);
+      return;
+  }
+  list_push_back (&closed_inodes, &inode->lru_elem);
+  inode = NULL;
+  if (++closed_cnt > INODE_LRU_MAX) {
+      inode = list_entry (list_pop_front (&closed_inodes), struct inode, lru_elem);
+      hash_delete (&open_inodes, &inode->hash_elem);
+      closed_cnt--;
+  }
+  lock_release(&inode_global_lock);
+  free (inode);
 }
 
 
@@ -400,15 +1031,20 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *cache = NULL;
+  const uint8_t *cache = NULL;
+  block_sector_t run_sector = -1;
+  size_t run_left = 0;
 //  uint8_t *bounce = NULL;
   
   if (offset >= inode_length(inode)) return 0;
     
   while (size > 0) 
     {
-      /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset, false);
+      /* Disk sector to read, starting byte offset within sector.
+         Sectors of a run are consecutive, so look up once per run. */
+      if (run_left == 0)
+        run_sector = byte_to_run (inode, offset, false, &run_left);
+      block_sector_t sector_idx = run_sector;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -421,9 +1057,11 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
         
-      if (sector_idx != -1) {
-          cache = cache_allocate_sector(sector_idx, CACHE_READ);
-          cache_read(cache, buffer+bytes_read, sector_ofs, chunk_size);
+      if (sector_idx != (block_sector_t) -1) {
+          /* copy straight out of the cache into the caller's buffer */
+          cache = cache_pin_read(sector_idx);
+          memcpy(buffer+bytes_read, cache+sector_ofs, chunk_size);
+          cache_unpin(cache, false);
       } else {
           memset(buffer+bytes_read, 0, chunk_size);
       }
@@ -432,12 +1070,62 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
+      if (sector_ofs + chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          run_left--;
+          if (run_sector != (block_sector_t) -1)
+            run_sector++;
+        }
     }
 //  free (bounce);
     
   return bytes_read;
 }
 
+/* Pins the sector holding byte OFFSET of INODE for shared
+   access and returns its contents, or a null pointer if OFFSET
+   falls in a hole or past end of file.  OFFSET should be
+   sector-aligned.  Release with inode_unpin(). */
+const void *
+inode_pin_read (const struct inode *inode, off_t offset)
+{
+  block_sector_t sector_idx;
+
+  if (offset >= inode_length (inode))
+    return NULL;
+  sector_idx = byte_to_sector (inode, offset, false);
+  return sector_idx != (block_sector_t) -1 ? cache_pin_read (sector_idx) : NULL;
+}
+
+/* Releases a sector pinned by inode_pin_read().  Null pointers
+   are ignored. */
+void
+inode_unpin (const void *sector)
+{
+  if (sector != NULL)
+    cache_unpin (sector, false);
+}
+
+/* Queues the sectors backing SIZE bytes of INODE starting at
+   OFFSET for background read into the buffer cache.  Holes and
+   bytes past end of file are skipped. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t length = inode_length (inode);
+  off_t end = offset + size < length ? offset + size : length;
+  off_t ofs = offset - offset % BLOCK_SECTOR_SIZE;
+  size_t run;
+
+  while (ofs < end)
+    {
+      block_sector_t sector_idx = byte_to_run (inode, ofs, false, &run);
+      for (; run > 0 && ofs < end; run--, ofs += BLOCK_SECTOR_SIZE)
+        if (sector_idx != (block_sector_t) -1)
+          cache_prefetch (sector_idx++);
+    }
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
@@ -458,9 +1146,15 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   size_t new_length = offset + size;
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
+      /* Sector to write, starting byte offset within sector.
+         Allocating it is an operation of its own; copying the
+         data in may fault on a user page, so it stays outside. */
+      if (!inode->sync_meta && byte_to_sector (inode, offset, false) == BITMAP_ERROR)
+        inode->sync_meta = true;
+      journal_begin (JOURNAL_INODE_BLOCKS);
       block_sector_t sector_idx = byte_to_sector (inode, offset, true);
-      if (sector_idx == BITMAP_ERROR) return bytes_written;
+      journal_end ();
+      if (sector_idx == BITMAP_ERROR) break;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -473,7 +1167,11 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
       
-      cache = cache_allocate_sector(sector_idx, CACHE_WRITE);
+      /* full sector writes don't need the old contents */
+      cache = cache_allocate_sector(sector_idx, chunk_size == BLOCK_SECTOR_SIZE
+                                    ? CACHE_WRITE_ALLOCATE : CACHE_WRITE);
+      if (inode->isdir || inode->metadata)
+        cache_log(cache);
       cache_write(cache, buffer+bytes_written, sector_ofs, chunk_size);
         
       /* Advance. */
@@ -481,21 +1179,100 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       offset += chunk_size;
       bytes_written += chunk_size;
         
-        /* update inode length after write */
-        if (offset > inode_length(inode)) {
+        /* make the chunk visible to readers; the disk inode
+           is updated once, below */
+        if (offset > inode->length) {
             lock_acquire(&inode->inode_lock);
-            if (offset > inode_length(inode)) {
-                void *cache = cache_allocate_sector(inode->sector, CACHE_WRITE);
-                cache_write(cache, &offset, 0, ENTRY_SIZE);
+            if (offset > inode->length) {
+                inode->length = offset;
+                inode->meta_dirty = true;
+                inode->sync_meta = true;
             }
             lock_release(&inode->inode_lock);
         }
         
     }
     
+  inode_flush_meta (inode);
   return bytes_written;
 }
 
+/* Writes back the inode in INODE_SECTOR and the index blocks or
+   extent leaves that map its data. */
+static void
+inode_sync_map (block_sector_t inode_sector)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  uint32_t *index = malloc (BLOCK_SECTOR_SIZE);
+  size_t i, j;
+
+  if (disk_inode == NULL || index == NULL)
+    {
+      free (disk_inode);
+      free (index);
+      cache_flush ();
+      return;
+    }
+
+  cache_read (cache_allocate_sector (inode_sector, CACHE_READ),
+              disk_inode, 0, BLOCK_SECTOR_SIZE);
+  cache_sync (inode_sector, 1);
+  if (disk_inode->magic == INODE_EXTENT_MAGIC)
+    {
+      extent_sync (disk_inode->extents, disk_inode->extent_cnt,
+                   disk_inode->extent_depth);
+    }
+  else
+    {
+      for (i = 0; i < NUM_INDIRECT; i++)
+        if (disk_inode->indirect_single_blocks[i] != BITMAP_ERROR)
+          cache_sync (disk_inode->indirect_single_blocks[i], 1);
+      for (i = 0; i < NUM_DOUBLE_INDIRECT; i++)
+        {
+          block_sector_t sector = disk_inode->indirect_double_blocks[i];
+          if (sector == BITMAP_ERROR)
+            continue;
+          cache_read (cache_allocate_sector (sector, CACHE_READ),
+                      index, 0, BLOCK_SECTOR_SIZE);
+          cache_sync (sector, 1);
+          for (j = 0; j < NUM_ENTRY_INDIRECT_SINGLE; j++)
+            if (index[j] != BITMAP_ERROR)
+              cache_sync (index[j], 1);
+        }
+    }
+  free (index);
+  free (disk_inode);
+}
+
+/* Writes INODE's dirty data blocks to disk, then makes its
+   metadata durable too, unless DATASYNC and neither its length
+   nor its block map changed since the last sync: reading the data
+   back does not need it then.  Other files' dirty blocks stay in
+   the cache.  With a journal, metadata is made durable by a
+   commit, which writes no block in place; without one, the inode
+   and its index blocks or extent leaves are written back. */
+void
+inode_sync (struct inode *inode, bool datasync)
+{
+  block_sector_t sector;
+  size_t run;
+  off_t pos;
+
+  for (pos = 0; pos < inode_length (inode); pos += run * BLOCK_SECTOR_SIZE)
+    {
+      sector = byte_to_run (inode, pos, false, &run);
+      if (sector != (block_sector_t) -1)
+        cache_sync (sector, run);
+    }
+
+  if (datasync && !inode->sync_meta)
+    return;
+  inode->sync_meta = false;
+  inode_flush_meta (inode);
+  if (!journal_commit ())
+    inode_sync_map (inode->sector);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -520,10 +1297,7 @@ inode_allow_write (struct inode *inode)
 off_t
 inode_length (const struct inode *inode)
 {
-  off_t length = 0;
-  void *cache = cache_allocate_sector(inode->sector, CACHE_READ);
-  cache_read(cache, &length, 0, sizeof(length));
-  return length;
+  return inode->length;
 }
 
 /* Returns whether inode is directory. */
@@ -531,20 +1305,67 @@ bool
 inode_isdir(const struct inode *inode)
 {
     if (inode == NULL) return false;
-    bool isdir;
-    off_t offset = INODE_META_SIZE + (NUM_DIRECT+NUM_INDIRECT+NUM_DOUBLE_INDIRECT) * ENTRY_SIZE;
-    void *cache = cache_allocate_sector(inode->sector, CACHE_READ);
-    cache_read(cache, &isdir, offset, sizeof(isdir));
-    return isdir;
+    return inode->isdir;
+}
+
+/* Returns the lock that serializes changes to directory INODE
+   against lookups in it. */
+struct rwlock *
+inode_dir_lock (struct inode *inode)
+{
+  return &inode->dir_lock;
 }
 
 /* set inode as dir */
 void
-inode_setdir(const struct inode *inode, bool isdir)
+inode_setdir(struct inode *inode, bool isdir)
 {
     off_t offset = INODE_META_SIZE + (NUM_DIRECT+NUM_INDIRECT+NUM_DOUBLE_INDIRECT) * ENTRY_SIZE;
+    journal_begin(JOURNAL_INODE_BLOCKS);
+    lock_acquire(&inode->inode_lock);
+    inode->isdir = isdir;
     void *cache = cache_allocate_sector(inode->sector, CACHE_WRITE);
+    cache_log(cache);
     cache_write(cache, &isdir, offset, sizeof(isdir));
+    lock_release(&inode->inode_lock);
+    journal_end();
+}
+
+/* Returns the sector of INODE's companion inode, or -1 if it has
+   none.  A companion inode holds data kept beside INODE's own,
+   such as a directory's name index, and is removed with it. */
+block_sector_t
+inode_get_aux (const struct inode *inode)
+{
+  return inode->aux_sector;
+}
+
+/* Makes the inode in SECTOR, or none if SECTOR is -1, INODE's
+   companion inode.  The previous one, if any, is left to the
+   caller. */
+void
+inode_set_aux (struct inode *inode, block_sector_t sector)
+{
+  struct inode_disk *disk_inode;
+
+  journal_begin (JOURNAL_INODE_BLOCKS);
+  lock_acquire (&inode->inode_lock);
+  inode->aux_sector = sector;
+  disk_inode = cache_pin_write (inode->sector);
+  disk_inode->aux_sector = sector;
+  cache_log (disk_inode);
+  cache_unpin (disk_inode, true);
+  lock_release (&inode->inode_lock);
+  journal_end ();
+}
+
+/* Marks INODE's data as file system metadata, such as the free
+   map, whose changes go through the journal.  Directories are
+   always treated so. */
+void
+inode_set_metadata (struct inode *inode)
+{
+  inode->metadata = true;
 }
 
 int
@@ -553,3 +1374,22 @@ inode_open_cnt(const struct inode* inode)
     if (inode == NULL) return 0;
     return inode->open_cnt;
 }
+
+/* Makes inode_create() use extents, rather than index blocks, to
+   map data if EXTENTS is true.  Only used when formatting; the
+   layout of an existing file system is set by inode_load_layout(). */
+void
+inode_set_extents (bool extents)
+{
+  use_extents = extents;
+}
+
+/* Picks the layout for new inodes of a mounted file system, which
+   is that of its free map inode. */
+void
+inode_load_layout (void)
+{
+  const struct inode_disk *disk_inode = cache_pin_read (FREE_MAP_SECTOR);
+  use_extents = disk_inode->magic == INODE_EXTENT_MAGIC;
+  cache_unpin (disk_inode, false);
+}
@@ -6,6 +6,7 @@
 #include "devices/block.h"
 
 struct bitmap;
+struct rwlock;
 
 void inode_init (void);
 bool inode_create (block_sector_t, off_t, bool);
@@ -15,13 +16,23 @@ block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+void inode_read_ahead (struct inode *, off_t offset, off_t size);
+const void *inode_pin_read (const struct inode *, off_t offset);
+void inode_unpin (const void *);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
 
 bool inode_isdir(const struct inode *);
-void inode_setdir(const struct inode *, bool);
+void inode_setdir(struct inode *, bool);
+struct rwlock *inode_dir_lock (struct inode *);
 int inode_open_cnt(const struct inode*);
+block_sector_t inode_get_aux (const struct inode *);
+void inode_set_aux (struct inode *, block_sector_t);
+void inode_set_metadata (struct inode *);
+void inode_sync (struct inode *, bool datasync);
+void inode_set_extents (bool);
+void inode_load_layout (void);
 
 #endif /* filesys/inode.h */
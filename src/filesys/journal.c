@@ -0,0 +1,718 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata journal.
+
+   Changed metadata blocks -- inodes, index blocks, extent leaves,
+   directories, directory indexes and the free map -- stay in the
+   buffer cache until they are in the log, a run of sectors that
+   journal_create() reserves when formatting.  Once a period the
+   cache's flush thread commits all of them as one transaction,
+   appended to the log: descriptors naming the blocks' home
+   sectors, the blocks themselves, and a commit record whose
+   checksum covers the rest.  Committed blocks go home with
+   ordinary write-back, whenever the cache gets to them; only
+   when the log is nearly full is everything written home and the
+   log started over.
+
+   Operations that change metadata run between journal_begin()
+   and journal_end(), and a commit first waits for those running
+   to finish, so no transaction holds half of one.  A transaction
+   is never split: journal_begin() takes the number of blocks the
+   operation may change, reserves room in the log for it, and
+   commits early rather than let the next transaction outgrow the
+   rest of the log.  Should one outgrow it anyway, the log's
+   committed blocks are written home straight from the log to make
+   room.  On mount, journal_open() writes the last committed copy
+   of every logged block home.
+
+   A freed sector that held logged metadata may be reused for
+   file data, which is not logged.  Freeing revokes its copies in
+   the log: the next transaction records the revocation, and
+   replay skips copies older than it. */
+
+#define JOURNAL_MAGIC 0x4a524e4c        /* Journal header. */
+#define DESC_MAGIC 0x4a445343           /* Descriptor. */
+#define COMMIT_MAGIC 0x4a434d54         /* Commit record. */
+
+/* The log gets one sector per JOURNAL_RATIO of the disk, within
+   these bounds. */
+#define JOURNAL_RATIO 16
+#define JOURNAL_MIN 256
+#define JOURNAL_MAX 2048
+
+/* Sector numbers a descriptor has room for. */
+#define DESC_ENTRIES 124
+
+/* First sector of the journal; the log follows it. */
+struct journal_header
+  {
+    uint32_t magic;
+    uint32_t size;                      /* Sectors in the log. */
+    uint32_t seq;                       /* Number of the transaction
+                                           at the start of the log. */
+    uint32_t unused[125];
+  };
+
+/* Starts a part of transaction SEQ: REVOKE_CNT revoked runs of
+   sectors, as (first, count) pairs, then the home sectors of the
+   BLOCK_CNT blocks in the log sectors that follow. */
+struct journal_desc
+  {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t block_cnt;
+    uint32_t revoke_cnt;
+    uint32_t entries[DESC_ENTRIES];
+  };
+
+/* Ends transaction SEQ. */
+struct journal_commit
+  {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t checksum;                  /* Sum of checksum() over the
+                                           transaction's other sectors. */
+    uint32_t unused[125];
+  };
+
+/* A journal sector being read or written. */
+union journal_sector
+  {
+    struct journal_header header;
+    struct journal_desc desc;
+    struct journal_commit commit;
+  };
+
+static bool journal_on;                 /* Logging metadata? */
+static block_sector_t header_sector;    /* Journal header. */
+static size_t log_size;                 /* Sectors in the log. */
+static size_t head;                     /* Next free log sector. */
+static uint32_t seq;                    /* Number of next transaction. */
+static uint32_t first_seq;              /* Number of first one in log. */
+static uint32_t txn_sum;                /* Checksum of it so far. */
+static union journal_sector *buf;
+static struct lock commit_lock;         /* Guards the members above. */
+
+/* Operations running, the blocks reserved for them, and whether a
+   commit keeps new ones from starting.  handle_cv is signaled when
+   any of them changes. */
+static int active;
+static size_t reserved;
+static bool committing;
+static struct lock handle_lock;
+static struct condition handle_cv;
+
+/* Sectors with a copy in the log and their number, sectors of
+   them freed since the last commit, and the next one to put into
+   the log. */
+static struct bitmap *logged;
+static size_t logged_cnt;
+static struct bitmap *revoked;
+static size_t revoke_cnt;
+static size_t revoke_next;
+static struct lock revoke_lock;
+
+/* Scratch space for writing the log home: the log sector of each
+   transaction, a sector, and the sectors already written. */
+static size_t *replay_txns;
+static void *replay_data;
+static struct bitmap *replay_done;
+
+static bool sync (size_t blocks);
+static void clear_revokes (void);
+
+/* Returns a checksum of the sector in DATA. */
+static uint32_t
+checksum (const void *data)
+{
+  const uint32_t *p = data;
+  uint32_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < BLOCK_SECTOR_SIZE / sizeof *p; i++)
+    sum = ((sum << 1) | (sum >> 31)) ^ p[i];
+  return sum;
+}
+
+static void
+log_read (size_t pos, void *data)
+{
+  block_read (fs_device, header_sector + 1 + pos, data);
+}
+
+static void
+log_write (size_t pos, const void *data)
+{
+  block_write (fs_device, header_sector + 1 + pos, data);
+}
+
+/* Initializes the journal module. */
+void
+journal_init (void)
+{
+  lock_init (&commit_lock);
+  lock_init (&handle_lock);
+  cond_init (&handle_cv);
+  lock_init (&revoke_lock);
+  buf = malloc (sizeof *buf);
+  if (buf == NULL)
+    PANIC ("no memory for journal");
+}
+
+/* Reserves an empty journal on a file system being formatted and
+   records where it is in the free map inode's companion sector. */
+void
+journal_create (void)
+{
+  size_t size = block_size (fs_device) / JOURNAL_RATIO;
+  block_sector_t sector;
+  struct inode *inode;
+  size_t i;
+
+  if (size < JOURNAL_MIN)
+    size = JOURNAL_MIN;
+  if (size > JOURNAL_MAX)
+    size = JOURNAL_MAX;
+  if (!free_map_allocate (size + 1, &sector))
+    PANIC ("journal creation failed");
+
+  /* Clear the log, so that what an earlier file system left there
+     cannot pass for a transaction. */
+  header_sector = sector;
+  memset (buf, 0, sizeof *buf);
+  for (i = 0; i < size; i++)
+    log_write (i, buf);
+  buf->header.magic = JOURNAL_MAGIC;
+  buf->header.size = size;
+  buf->header.seq = 0;
+  block_write (fs_device, sector, buf);
+
+  inode = inode_open (FREE_MAP_SECTOR);
+  inode_set_aux (inode, sector);
+  inode_close (inode);
+}
+
+/* Returns the log sector after the transaction numbered NUMBER
+   that starts at log sector POS, or 0 if there is no complete
+   transaction with that number there.  DATA is a scratch sector. */
+static size_t
+txn_scan (size_t pos, uint32_t number, void *data)
+{
+  uint32_t sum = 0;
+  size_t i;
+
+  while (pos < log_size)
+    {
+      log_read (pos++, buf);
+      if (buf->commit.magic == COMMIT_MAGIC && buf->commit.seq == number)
+        return buf->commit.checksum == sum ? pos : 0;
+      if (buf->desc.magic != DESC_MAGIC || buf->desc.seq != number
+          || buf->desc.block_cnt + 2 * buf->desc.revoke_cnt > DESC_ENTRIES
+          || buf->desc.block_cnt > log_size - pos)
+        return 0;
+      sum += checksum (buf);
+      for (i = buf->desc.block_cnt; i > 0; i--)
+        {
+          log_read (pos++, data);
+          sum += checksum (data);
+        }
+    }
+  return 0;
+}
+
+/* Writes home the blocks of the transaction at log sector POS
+   that DONE does not have, adding them to DONE, then adds the
+   sectors it revokes to DONE.  Writes through the cache, or if
+   DIRECT straight to disk, leaving the cache alone. */
+static void
+txn_replay (size_t pos, struct bitmap *done, bool direct)
+{
+  size_t start = pos, i;
+
+  for (; log_read (pos, buf), buf->desc.magic == DESC_MAGIC;
+       pos += 1 + buf->desc.block_cnt)
+    for (i = 0; i < buf->desc.block_cnt; i++)
+      {
+        block_sector_t sector = buf->desc.entries[2 * buf->desc.revoke_cnt + i];
+        void *cache;
+
+        if (sector >= bitmap_size (done) || bitmap_test (done, sector))
+          continue;
+        if (direct)
+          {
+            log_read (pos + 1 + i, replay_data);
+            block_write (fs_device, sector, replay_data);
+          }
+        else
+          {
+            cache = cache_allocate_sector (sector, CACHE_WRITE_ALLOCATE);
+            log_read (pos + 1 + i, cache);
+            cache_unpin (cache, true);
+          }
+        bitmap_mark (done, sector);
+      }
+
+  for (pos = start; log_read (pos, buf), buf->desc.magic == DESC_MAGIC;
+       pos += 1 + buf->desc.block_cnt)
+    for (i = 0; i < buf->desc.revoke_cnt; i++)
+      {
+        size_t first = buf->desc.entries[2 * i];
+        size_t cnt = buf->desc.entries[2 * i + 1];
+
+        if (first < bitmap_size (done) && cnt <= bitmap_size (done) - first)
+          bitmap_set_multiple (done, first, cnt, true);
+      }
+}
+
+/* Finds the committed transactions in the log, from sector 0 and
+   transaction number FIRST_SEQ on, and stores their log sectors
+   into replay_txns.  Returns how many there are. */
+static size_t
+txn_find (void)
+{
+  size_t txn_cnt = 0, pos = 0, next;
+
+  while (pos < log_size
+         && (next = txn_scan (pos, first_seq + txn_cnt, replay_data)) != 0)
+    {
+      replay_txns[txn_cnt++] = pos;
+      pos = next;
+    }
+  return txn_cnt;
+}
+
+/* Starts the log over, empty. */
+static void
+log_reset (void)
+{
+  lock_acquire (&revoke_lock);
+  bitmap_set_all (logged, false);
+  logged_cnt = 0;
+  lock_release (&revoke_lock);
+
+  memset (buf, 0, sizeof *buf);
+  buf->header.magic = JOURNAL_MAGIC;
+  buf->header.size = log_size;
+  buf->header.seq = seq;
+  block_write (fs_device, header_sector, buf);
+  first_seq = seq;
+  head = 0;
+}
+
+/* Writes every committed block home and starts the log over.
+   Nothing may be waiting for the journal. */
+static void
+checkpoint (void)
+{
+  cache_flush ();
+  log_reset ();
+}
+
+/* Writes home, straight from the log, the last committed copy of
+   every block in it, then starts the log over.  Unlike
+   checkpoint(), this may run while blocks wait for the journal:
+   the cache has their new contents and the log their committed
+   ones.  Sectors revoked since the last commit are left alone,
+   since they may hold file data by now. */
+static void
+checkpoint_log (void)
+{
+  size_t txn_cnt = txn_find (), i;
+  size_t first, end = 0;
+
+  bitmap_set_all (replay_done, false);
+  lock_acquire (&revoke_lock);
+  while ((first = bitmap_scan (revoked, end, 1, true)) != BITMAP_ERROR)
+    {
+      end = bitmap_scan (revoked, first, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (revoked);
+      bitmap_set_multiple (replay_done, first, end - first, true);
+    }
+  lock_release (&revoke_lock);
+
+  for (i = txn_cnt; i-- > 0; )
+    txn_replay (replay_txns[i], replay_done, true);
+  clear_revokes ();
+  log_reset ();
+}
+
+/* Mounts the journal of the file system, if it has one, first
+   writing home whatever its log holds. */
+void
+journal_open (void)
+{
+  struct inode *inode = inode_open (FREE_MAP_SECTOR);
+  size_t txn_cnt, i;
+
+  header_sector = inode_get_aux (inode);
+  inode_close (inode);
+  if (header_sector == (block_sector_t) -1)
+    return;
+
+  lock_acquire (&commit_lock);
+  block_read (fs_device, header_sector, buf);
+  if (buf->header.magic != JOURNAL_MAGIC)
+    PANIC ("journal header is corrupt");
+  log_size = buf->header.size;
+  first_seq = buf->header.seq;
+
+  replay_txns = malloc (log_size / 2 * sizeof *replay_txns);
+  replay_data = malloc (BLOCK_SECTOR_SIZE);
+  replay_done = bitmap_create (block_size (fs_device));
+  logged = bitmap_create (block_size (fs_device));
+  revoked = bitmap_create (block_size (fs_device));
+  if (replay_txns == NULL || replay_data == NULL || replay_done == NULL
+      || logged == NULL || revoked == NULL)
+    PANIC ("no memory for journal");
+
+  /* Find the committed transactions, then replay them newest
+     first, so each block gets its last committed copy. */
+  txn_cnt = txn_find ();
+  seq = first_seq + txn_cnt;
+  for (i = txn_cnt; i-- > 0; )
+    txn_replay (replay_txns[i], replay_done, false);
+  if (txn_cnt > 0)
+    printf ("journal: replayed %zu transactions.\n", txn_cnt);
+
+  checkpoint ();
+  journal_on = true;
+  cache_set_logging (true);
+  lock_release (&commit_lock);
+}
+
+/* Returns the log sectors a transaction of BLOCKS blocks and
+   REVOKES revoked runs takes at most. */
+static size_t
+txn_size (size_t blocks, size_t revokes)
+{
+  return DIV_ROUND_UP (blocks + 2 * revokes, DESC_ENTRIES) + blocks + 1;
+}
+
+/* Returns true if the next transaction still fits in the rest of
+   the log, and in the cache, with BLOCKS more blocks reserved for
+   operations than now.  Only sectors with a copy in the log can
+   be revoked, and the free map is one block per allocation group,
+   which bounds what revocations and the free map add to it. */
+static bool
+has_room (size_t blocks)
+{
+  size_t revokes;
+
+  if (!journal_on)
+    return true;
+  if (cache_log_crowded ())
+    return false;
+  blocks += cache_log_count () + free_map_sectors () + reserved;
+  lock_acquire (&revoke_lock);
+  revokes = logged_cnt;
+  lock_release (&revoke_lock);
+  return txn_size (blocks, revokes) <= log_size - head;
+}
+
+/* Starts an operation that changes at most BLOCKS metadata blocks,
+   not counting the free map.  Calls nest; only the outermost
+   counts, so its BLOCKS must cover the inner ones', and only it
+   waits for a commit in progress.
+
+   Blocks waiting for the journal cannot be evicted, and a
+   transaction must fit in the rest of the log, so when either
+   would run short with one more operation the outermost call
+   commits first, once the running ones have ended, while the
+   caller is not part of an operation the commit would wait for.
+   An operation too big for even an empty log runs alone. */
+void
+journal_begin (size_t blocks)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0)
+    return;
+  lock_acquire (&handle_lock);
+  for (;;)
+    {
+      if (committing || (active > 0 && !has_room (blocks)))
+        cond_wait (&handle_cv, &handle_lock);
+      else if (!has_room (blocks)
+               && (head > 0 || cache_log_count () > 0))
+        {
+          lock_release (&handle_lock);
+          t->journal_depth--;
+          sync (blocks);
+          t->journal_depth++;
+          lock_acquire (&handle_lock);
+        }
+      else
+        break;
+    }
+  active++;
+  reserved += blocks;
+  t->journal_blocks = blocks;
+  lock_release (&handle_lock);
+}
+
+/* Ends an operation started by journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+  lock_acquire (&handle_lock);
+  reserved -= t->journal_blocks;
+  if (--active == 0)
+    cond_broadcast (&handle_cv, &handle_lock);
+  lock_release (&handle_lock);
+}
+
+/* Waits for running operations to end and holds off new ones.
+   The caller's own changes count as part of one operation. */
+static void
+quiesce (void)
+{
+  lock_acquire (&handle_lock);
+  committing = true;
+  while (active > 0)
+    cond_wait (&handle_cv, &handle_lock);
+  lock_release (&handle_lock);
+  thread_current ()->journal_depth++;
+}
+
+/* Lets operations run again after quiesce(). */
+static void
+resume (void)
+{
+  thread_current ()->journal_depth--;
+  lock_acquire (&handle_lock);
+  committing = false;
+  cond_broadcast (&handle_cv, &handle_lock);
+  lock_release (&handle_lock);
+}
+
+/* Adds the revoked runs to the descriptor in BUF while it has
+   room.  Returns false if some did not fit. */
+static bool
+put_revokes (void)
+{
+  struct journal_desc *desc = &buf->desc;
+
+  lock_acquire (&revoke_lock);
+  while (revoke_cnt > 0 && revoke_next < bitmap_size (revoked))
+    {
+      size_t first = bitmap_scan (revoked, revoke_next, 1, true), end;
+
+      if (first == BITMAP_ERROR)
+        break;
+      if (2 * (desc->revoke_cnt + 1) > DESC_ENTRIES)
+        {
+          lock_release (&revoke_lock);
+          return false;
+        }
+      end = bitmap_scan (revoked, first, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (revoked);
+      desc->entries[2 * desc->revoke_cnt] = first;
+      desc->entries[2 * desc->revoke_cnt + 1] = end - first;
+      desc->revoke_cnt++;
+      revoke_next = end;
+    }
+  lock_release (&revoke_lock);
+  return true;
+}
+
+/* Forgets the revocations, once they are in the log or there is
+   nothing left in it for them to apply to. */
+static void
+clear_revokes (void)
+{
+  lock_acquire (&revoke_lock);
+  if (revoke_cnt > 0)
+    bitmap_set_all (revoked, false);
+  revoke_cnt = 0;
+  revoke_next = 0;
+  lock_release (&revoke_lock);
+}
+
+/* Appends the changed metadata block in SECTOR, whose contents
+   are DATA, to the transaction being written, unless the sector
+   has been freed since. */
+static bool
+log_block (block_sector_t sector, const void *data)
+{
+  struct journal_desc *desc = &buf->desc;
+
+  if (!free_map_in_use (sector))
+    return false;
+  lock_acquire (&revoke_lock);
+  if (!bitmap_test (logged, sector))
+    {
+      bitmap_mark (logged, sector);
+      logged_cnt++;
+    }
+  lock_release (&revoke_lock);
+  log_write (head++, data);
+  txn_sum += checksum (data);
+  desc->entries[2 * desc->revoke_cnt + desc->block_cnt++] = sector;
+  return true;
+}
+
+/* Writes a transaction of the revocations and the metadata blocks
+   changed since the last one.  Returns false if the log filled up
+   before all of them were in it. */
+static bool
+txn_write (void)
+{
+  struct journal_desc *desc = &buf->desc;
+  size_t start = head, desc_pos, room;
+  bool done = false;
+
+  txn_sum = 0;
+  while (!done && log_size - head >= 3)
+    {
+      /* Fill a descriptor, leaving room for the commit record. */
+      desc_pos = head++;
+      memset (desc, 0, sizeof *desc);
+      desc->magic = DESC_MAGIC;
+      desc->seq = seq;
+      done = put_revokes ();
+      room = DESC_ENTRIES - 2 * desc->revoke_cnt;
+      if (room > log_size - head - 1)
+        room = log_size - head - 1;
+      if (done && cache_log_pending (room, log_block) == room)
+        done = false;
+
+      if (desc->block_cnt == 0 && desc->revoke_cnt == 0)
+        {
+          head--;
+          done = true;
+          break;
+        }
+      txn_sum += checksum (desc);
+      log_write (desc_pos, desc);
+    }
+
+  if (head > start)
+    {
+      memset (buf, 0, sizeof *buf);
+      buf->commit.magic = COMMIT_MAGIC;
+      buf->commit.seq = seq++;
+      buf->commit.checksum = txn_sum;
+      log_write (head++, buf);
+    }
+  cache_log_done ();
+  clear_revokes ();
+  return done;
+}
+
+/* Commits the free map and every changed metadata block as one
+   transaction.  journal_begin() sees to it that the transaction
+   fits in the rest of the log, unless operations changed more
+   blocks than they said they would; then the log is written home
+   first to make room.  checkpoint() would not do, as it writes
+   the pending blocks home too, before they are committed.
+   journal_begin() lets no operation outgrow an empty log, except
+   one that runs alone in it. */
+static void
+commit (void)
+{
+  size_t revokes;
+
+  free_map_flush ();
+  lock_acquire (&revoke_lock);
+  revokes = revoke_cnt;
+  lock_release (&revoke_lock);
+  if (txn_size (cache_log_count (), revokes) > log_size - head)
+    checkpoint_log ();
+  if (!txn_write ())
+    PANIC ("journal: transaction does not fit in the log");
+}
+
+/* Commits the changes of all operations that have ended, and
+   checkpoints once the log may not take another full descriptor
+   or another operation of BLOCKS blocks.
+   Without a journal, just writes the free map to the cache and
+   returns false. */
+static bool
+sync (size_t blocks)
+{
+  bool on;
+
+  ASSERT (thread_current ()->journal_depth == 0);
+
+  lock_acquire (&commit_lock);
+  on = journal_on;
+  if (on)
+    {
+      quiesce ();
+      commit ();
+      if (log_size - head < DESC_ENTRIES + 2 || !has_room (blocks))
+        checkpoint ();
+      resume ();
+    }
+  else
+    free_map_flush ();
+  lock_release (&commit_lock);
+  return on;
+}
+
+/* Commits the changes of all operations that have ended, and
+   checkpoints once the log may not take another full descriptor
+   or another operation.
+   Without a journal, just writes the free map to the cache and
+   returns false. */
+bool
+journal_commit (void)
+{
+  return sync (1);
+}
+
+/* Commits and checkpoints everything and stops logging, leaving
+   the log empty. */
+void
+journal_close (void)
+{
+  lock_acquire (&commit_lock);
+  if (journal_on)
+    {
+      quiesce ();
+      commit ();
+      checkpoint ();
+      journal_on = false;
+      cache_set_logging (false);
+      resume ();
+    }
+  lock_release (&commit_lock);
+}
+
+/* Revokes the copies in the log of the CNT sectors from SECTOR,
+   which are being freed. */
+void
+journal_revoke (block_sector_t sector, size_t cnt)
+{
+  block_sector_t s;
+
+  if (!journal_on)
+    return;
+  lock_acquire (&revoke_lock);
+  for (s = sector; s < sector + cnt; s++)
+    if (bitmap_test (logged, s) && !bitmap_test (revoked, s))
+      {
+        bitmap_mark (revoked, s);
+        revoke_cnt++;
+      }
+  lock_release (&revoke_lock);
+}
@@ -0,0 +1,26 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+void journal_init (void);
+void journal_create (void);
+void journal_open (void);
+void journal_close (void);
+
+/* Metadata blocks, besides the free map, that operations change
+   at most, for journal_begin(): changing an inode, or mapping one
+   more block of a file into it, which may split every level of
+   its extent tree; and adding or removing a name in a directory,
+   the named inode and the directory's index included. */
+#define JOURNAL_INODE_BLOCKS 12
+#define JOURNAL_DIR_BLOCKS 48
+
+void journal_begin (size_t blocks);
+void journal_end (void);
+bool journal_commit (void);
+void journal_revoke (block_sector_t, size_t);
+
+#endif /* filesys/journal.h */
@@ -15,6 +15,37 @@ typedef int mapid_t;
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
+/* Directory entry written by getdents(). */
+struct dirent
+  {
+    int inumber;                        /* Inode number. */
+    bool isdir;                         /* Is a directory? */
+    char name[READDIR_MAX_LEN + 1];     /* Null terminated name. */
+  };
+
+/* Most entries a single getdents() call returns. */
+#define GETDENTS_MAX 64
+
+/* Buffer cache statistics written by cachestat().  Latency
+   histograms are in timer ticks: bucket 0 counts events shorter
+   than one tick, bucket I counts those of 2**(I-1) up to 2**I
+   ticks, and the last bucket everything longer. */
+#define CACHESTAT_BUCKETS 8
+struct cache_stats
+  {
+    unsigned long long blocks;          /* Current size of the cache. */
+    unsigned long long hits;            /* Lookups served by the cache. */
+    unsigned long long misses;          /* Lookups that allocated a block. */
+    unsigned long long evictions;       /* Blocks taken from another sector. */
+    unsigned long long write_backs;     /* Dirty blocks written to disk. */
+    unsigned long long flushes;         /* Write-behind passes that wrote. */
+    unsigned long long flush_ticks;     /* Total time of those passes. */
+    unsigned long long waits;           /* Waits for a busy block. */
+    unsigned long long wait_ticks;      /* Total time of those waits. */
+    unsigned long long flush_hist[CACHESTAT_BUCKETS];
+    unsigned long long wait_hist[CACHESTAT_BUCKETS];
+  };
+
 /* Typical return values from main() and arguments to exit(). */
 #define EXIT_SUCCESS 0          /* Successful execution. */
 #define EXIT_FAILURE 1          /* Unsuccessful execution. */
@@ -44,5 +75,9 @@ bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
+void cachestat (struct cache_stats *);
+int getdents (int fd, struct dirent *, unsigned cnt);
+bool fsync (int fd);
+bool fdatasync (int fd);
 
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,139 @@
+/* Test program for lib/kernel/bitmap.c.
+
+   Checks bitmap_scan() against a straightforward bit-at-a-time
+   scan, then times both on a bitmap the size of the free map of
+   a 1 GiB disk that is mostly full.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/test.h"
+
+/* Sectors in a 1 GiB disk. */
+#define DISK_SECTORS (1024 * 1024 * 1024 / 512)
+
+/* Bits in the bitmap used for checking results. */
+#define CHECK_BITS 8192
+
+/* Number of timed scans per request size. */
+#define SCANS 64
+
+static size_t slow_scan (const struct bitmap *, size_t start, size_t cnt);
+static void fill (struct bitmap *, int free_pct);
+static void check (struct bitmap *);
+static void bench (struct bitmap *, size_t cnt);
+
+/* Test and benchmark bitmap_scan(). */
+void
+test (void)
+{
+  struct bitmap *b;
+  int free_pct;
+
+  b = bitmap_create (CHECK_BITS);
+  ASSERT (b != NULL);
+  printf ("checking scans:");
+  for (free_pct = 0; free_pct <= 100; free_pct += 10)
+    {
+      printf (" %d%% free", free_pct);
+      fill (b, free_pct);
+      check (b);
+    }
+  printf (" done\n");
+  bitmap_destroy (b);
+
+  /* A nearly full disk: 2% of its first 95% is free, scattered,
+     and the last twentieth is untouched. */
+  b = bitmap_create (DISK_SECTORS);
+  ASSERT (b != NULL);
+  fill (b, 2);
+  bitmap_set_multiple (b, DISK_SECTORS / 20 * 19, DISK_SECTORS / 20, false);
+  bench (b, 1);
+  bench (b, 8);
+  bench (b, 64);
+
+  bitmap_destroy (b);
+}
+
+/* Returns the first of CNT free bits in B at or after START, the
+   way bitmap_scan() used to find them. */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t cnt)
+{
+  size_t i, j;
+
+  for (i = start; i + cnt <= bitmap_size (b); i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j))
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Marks every bit of B in use except FREE_PCT percent of them,
+   chosen at random. */
+static void
+fill (struct bitmap *b, int free_pct)
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, random_ulong () % 100 >= (unsigned) free_pct);
+}
+
+/* Compares bitmap_scan() and slow_scan() from random places in
+   B. */
+static void
+check (struct bitmap *b)
+{
+  int i;
+
+  for (i = 0; i < 256; i++)
+    {
+      size_t start = random_ulong () % (bitmap_size (b) + 1);
+      size_t cnt = random_ulong () % 16 + 1;
+      size_t expected = slow_scan (b, start, cnt);
+
+      if (bitmap_scan (b, start, cnt, false) != expected)
+        PANIC ("bitmap_scan (%zu, %zu) should be %zu", start, cnt, expected);
+      if (expected != BITMAP_ERROR && bitmap_any (b, expected, cnt))
+        PANIC ("bitmap_scan returned bits in use");
+    }
+}
+
+/* Times SCANS scans for CNT free bits in B from random starting
+   points, done both ways, and prints the ticks each took. */
+static void
+bench (struct bitmap *b, size_t cnt)
+{
+  int64_t start;
+  int64_t fast_ticks, slow_ticks;
+  size_t starts[SCANS];
+  int i;
+
+  for (i = 0; i < SCANS; i++)
+    starts[i] = random_ulong () % DISK_SECTORS;
+
+  start = timer_ticks ();
+  for (i = 0; i < SCANS; i++)
+    bitmap_scan (b, starts[i], cnt, false);
+  fast_ticks = timer_elapsed (start);
+
+  start = timer_ticks ();
+  for (i = 0; i < SCANS; i++)
+    slow_scan (b, starts[i], cnt);
+  slow_ticks = timer_elapsed (start);
+
+  printf ("%d scans for %zu bits: %lld ticks, bit at a time %lld ticks\n",
+          SCANS, cnt, fast_ticks, slow_ticks);
+}
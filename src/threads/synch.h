@@ -41,6 +41,45 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.  Any number of readers, or one writer,
+   may hold it.  A writer keeps LOCK for its whole hold, so threads
+   blocked behind it donate their priority to it.  Readers only
+   pass through LOCK on the way in, which also keeps new readers
+   out while a writer waits for the current ones to leave. */
+struct rwlock
+  {
+    struct lock lock;           /* Held by the writer; gates readers. */
+    unsigned readers;           /* Number of readers holding it. */
+    bool draining;              /* A writer waits for readers to leave. */
+    struct semaphore drained;   /* Upped when the last reader leaves. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+bool rwlock_try_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+bool rwlock_try_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+void rwlock_downgrade (struct rwlock *);
+bool rwlock_held_for_write (const struct rwlock *);
+
+/* Sequence lock.  Writers serialize on LOCK and keep SEQ odd
+   while they update the data; readers take no lock at all and
+   retry if SEQ changed under them.  Suits small read-mostly data
+   whose readers can afford to retry. */
+struct seqlock
+  {
+    unsigned seq;               /* Odd while a write is in progress. */
+    struct lock lock;           /* Serializes writers. */
+  };
+
+void seqlock_init (struct seqlock *);
+void seqlock_write_begin (struct seqlock *);
+void seqlock_write_end (struct seqlock *);
+unsigned seqlock_read_begin (struct seqlock *);
+bool seqlock_read_retry (const struct seqlock *, unsigned seq);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
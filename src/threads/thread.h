@@ -162,6 +162,8 @@ struct thread
       
 #ifdef FILESYS
     struct inode* pwd;
+    int journal_depth;                  /* Nesting of journal_begin(). */
+    size_t journal_blocks;              /* Blocks it reserved. */
 #endif
       
     /* Owned by thread.c. */
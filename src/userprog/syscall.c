@@ -12,6 +12,8 @@
 #include "threads/vaddr.h"
 #include "filesys/file.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
+#include "filesys/directory.h"
 
 #include "threads/palloc.h"
 #include "threads/malloc.h"
@@ -82,6 +84,10 @@ static void sys_mkdir(uint32_t *eax, char** argv);
 static void sys_readdir(uint32_t *eax, char** argv);
 static void sys_isdir(uint32_t *eax, char** argv);
 static void sys_inumber(uint32_t *eax, char** argv);
+static void sys_cachestat(uint32_t *eax, char** argv);
+static void sys_getdents(uint32_t *eax, char** argv);
+static void sys_fsync(uint32_t *eax, char** argv);
+static void sys_fdatasync(uint32_t *eax, char** argv);
 
 void
 force_exit(void)
@@ -256,6 +262,20 @@ syscall_handler (struct intr_frame *f)
       case SYS_INUMBER:
           sys_inumber(eax, argv);
           break;
+      case SYS_CACHESTAT:
+          sys_cachestat(eax, argv);
+          break;
+      case SYS_GETDENTS:
+          argc = 3;
+          load_arguments(argc, args, argv);
+          sys_getdents(eax, argv);
+          break;
+      case SYS_FSYNC:
+          sys_fsync(eax, argv);
+          break;
+      case SYS_FDATASYNC:
+          sys_fdatasync(eax, argv);
+          break;
           
       default:
         break;
@@ -557,47 +577,8 @@ sys_mkdir(uint32_t *eax, char** argv)
     const char* dirname = *(char**)argv[0];
     validate_filename(dirname);
 
-    int success = 0;
-    
-    /* empty dir name is not allowed */
-    if (strcmp(dirname, "") != 0 && strcmp(dirname, "/") != 0)
-        success = filesys_create(dirname, 0);
-    if (!success) goto done;
-    
-    /* set file as directory */
-    struct file *dir_file = filesys_open(dirname);
-    ASSERT(dir_file != NULL);
-    struct inode* dir_inode = file_get_inode(dir_file);
-    inode_setdir(dir_inode, true);
-    
-    struct dir * curr_dir = dir_open(inode_reopen(dir_inode));
-    struct dir *upper_dir = NULL;
-    /* add . as dir entry */
-    success = dir_add(curr_dir, ".", inode_get_inumber(dir_inode));
-    if (!success) goto fail;
-    
-    /* add .. as dir entry */
-    char *upper_dirname = NULL;
-    upper_dir = parse_filepath(dirname, &upper_dirname, false);
-    ASSERT(upper_dir != NULL && upper_dirname != NULL);
-    success  = dir_add(curr_dir, "..", inode_get_inumber(dir_get_inode(upper_dir)));
-    
-//    printf("dir: %s, upper_dir: %d, upper inode: %d, curr inode: %d, success: %d\n",
-//           dirname, upper_dir==NULL, inode_get_inumber(dir_get_inode(upper_dir)),
-//           inode_get_inumber(dir_get_inode(curr_dir)),
-//           success);
-    
-    if (!success) goto fail;
-    
-    fail:
-//        sys_remove(eax, argv); remove the file afterwards
-        if (upper_dir != NULL) dir_close(upper_dir);
-        dir_close(curr_dir);
-        file_close(dir_file);
-    
-    done:
-      memcpy(eax, &success, sizeof(success));
-      return;
+    int success = filesys_mkdir(dirname);
+    memcpy(eax, &success, sizeof(success));
 }
 
 static void sys_readdir(uint32_t *eax, char** argv)
@@ -644,3 +625,73 @@ static void sys_inumber(uint32_t *eax, char** argv)
     int ret =  inode_get_inumber(file_get_inode(dir_file));
     memcpy(eax, &ret, sizeof(ret));
 }
+
+static void sys_cachestat(uint32_t *eax UNUSED, char** argv)
+{
+    struct cache_stats *stats = *(struct cache_stats**)argv[0];
+    struct cache_stats snapshot;
+    
+    validate_vaddr_write(stats, sizeof(*stats));
+    cache_get_stats(&snapshot);
+    memcpy(stats, &snapshot, sizeof(snapshot));
+}
+
+/* reads up to cnt entries of a directory at once, with their inode
+   number and type, skipping . and .. like sys_readdir */
+static void sys_getdents(uint32_t *eax, char** argv)
+{
+    int fd_no = *(int*)argv[0];
+    struct dirent *entries = *(struct dirent**)argv[1];
+    unsigned cnt = *(unsigned*)argv[2];
+    
+    int ret = -1;
+    if (cnt > GETDENTS_MAX) cnt = GETDENTS_MAX;
+    validate_vaddr_write(entries, cnt * sizeof(*entries));
+    
+    struct file *dir_file = fetch_file(fd_no);
+    if (dir_file == NULL) goto done;
+    struct inode* dir_inode = file_get_inode(dir_file);
+    if (!inode_isdir(dir_inode)) goto done;
+    
+    struct dir *dir = dir_open(inode_reopen(dir_inode));
+    struct dirent entry;
+    block_sector_t inumber;
+    bool isdir;
+    dir_seek(dir, file_tell(dir_file));
+    for (ret = 0; (unsigned) ret < cnt && dir_readdir_entry(dir, entry.name, &inumber, &isdir); ) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) continue;
+        
+        entry.inumber = inumber;
+        entry.isdir = isdir;
+        memcpy(&entries[ret++], &entry, sizeof(entry));
+    }
+    file_seek(dir_file, dir_tell(dir));
+    dir_close(dir);
+    
+    done:
+      memcpy(eax, &ret, sizeof(ret));
+}
+
+/* writes the file's dirty blocks and its metadata to disk, leaving
+   everyone else's dirty blocks in the cache */
+static void sys_fsync(uint32_t *eax, char** argv)
+{
+    int fd_no = *(int*)argv[0];
+    struct file *fp = fetch_file(fd_no);
+    int success = fp != NULL;
+    
+    if (success) inode_sync(file_get_inode(fp), false);
+    memcpy(eax, &success, sizeof(success));
+}
+
+/* like sys_fsync, but skips the metadata unless reading the data
+   back depends on it */
+static void sys_fdatasync(uint32_t *eax, char** argv)
+{
+    int fd_no = *(int*)argv[0];
+    struct file *fp = fetch_file(fd_no);
+    int success = fp != NULL;
+    
+    if (success) inode_sync(file_get_inode(fp), true);
+    memcpy(eax, &success, sizeof(success));
+}
@@ -14,6 +14,7 @@
 #include "userprog/pagedir.h"
 #include "vm/page.h"
 #include "vm/swap.h"
+#include "filesys/cache.h"
 
 static size_t frame_table_page_cnt;
 static struct lock frame_table_lock;
@@ -66,6 +67,10 @@ falloc_get_frame(void* vm_pg, void *eip, enum palloc_flags flags)
     
     void *page = palloc_get_page(flags);
     void *new_frame;
+    
+    /* kernel pages can come from the buffer cache before evicting */
+    if (page == NULL && !(flags & PAL_USER) && cache_shrink())
+        page = palloc_get_page(flags);
     if (page == NULL) {
         falloc_counter += 1;
         new_frame = next_frame_to_evict(eip, 1);
@@ -67,24 +67,14 @@ void
 swap_read(swap_slot_t slot, void *page)
 {
     ASSERT(pg_ofs(page) == 0);
-    block_sector_t sector = slot_to_sector(slot);
-    for (size_t i = 0; i < nblock_pg; i++) {
-        block_read(swap_block, sector, page);
-        sector += 1;
-        page += BLOCK_SECTOR_SIZE;
-    }
+    block_read_multiple(swap_block, slot_to_sector(slot), nblock_pg, page);
 }
 
 void
 swap_write(swap_slot_t slot, void *page)
 {
     ASSERT(pg_ofs(page) == 0);
-    block_sector_t sector = slot_to_sector(slot);
-    for (size_t i = 0; i < nblock_pg; i++) {
-        block_write(swap_block, sector, page);
-        sector += 1;
-        page += BLOCK_SECTOR_SIZE;
-    }
+    block_write_multiple(swap_block, slot_to_sector(slot), nblock_pg, page);
 }
 
 swap_slot_t